@@ -63,6 +63,10 @@ int grub_stage2 (void);
 #include <serial.h>
 #include <term.h>
 
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
 /* Simulated memory sizes. */
 #define EXTENDED_MEMSIZE (3 * 1024 * 1024)	/* 3MB */
 #define CONVENTIONAL_MEMSIZE (640 * 1024)	/* 640kB */
@@ -83,6 +87,29 @@ char *grub_scratch_mem = 0;
 
 struct geometry *disks = 0;
 
+#ifdef HAVE_SYS_MMAN_H
+/* The disk images mapped into memory, indexed by BIOS drive. Sectors
+   are read from ADDR directly, and written by write as usual, which
+   updates the mapping as well.  */
+static struct mapped_disk
+{
+  char *addr;
+  size_t size;
+  /* The end of the last read, to find out sequential reads.  */
+  size_t next;
+} *mapped_disks = 0;
+
+/* The size of the readahead for sequential reads.  */
+# define MAPPED_DISK_READAHEAD	0x40000
+#endif /* HAVE_SYS_MMAN_H */
+
+/* The disk images in the formats of diskimage.c, indexed by BIOS
+   drive.  */
+static struct disk_image **disk_images = 0;
+
+static void map_disk_image (int drive);
+static void unmap_disk_image (int drive);
+
 /* The map between BIOS drives and UNIX device file names.  */
 char **device_map = 0;
 
@@ -98,6 +125,11 @@ static int serial_fd = -1;
 /* The file name of a serial device.  */
 static char *serial_device = 0;
 
+/* The number of calls to biosdisk and of the sectors transferred,
+   reported in verbose mode.  */
+static unsigned long biosdisk_reads, biosdisk_read_sectors;
+static unsigned long biosdisk_writes, biosdisk_write_sectors;
+
 #ifdef SIMULATE_SLOWNESS_OF_SERIAL
 /* The speed of a serial device.  */
 static unsigned int serial_speed;
@@ -153,6 +185,20 @@ grub_stage2 (void)
   for (i = 0; i < NUM_DISKS; i++)
     disks[i].flags = -1;
 
+  assert (disk_images == 0);
+  disk_images = malloc (NUM_DISKS * sizeof (*disk_images));
+  assert (disk_images);
+  for (i = 0; i < NUM_DISKS; i++)
+    disk_images[i] = 0;
+
+#ifdef HAVE_SYS_MMAN_H
+  assert (mapped_disks == 0);
+  mapped_disks = malloc (NUM_DISKS * sizeof (*mapped_disks));
+  assert (mapped_disks);
+  for (i = 0; i < NUM_DISKS; i++)
+    mapped_disks[i].addr = 0;
+#endif
+
   if (! init_device_map (&device_map, device_map_file, floppy_disks))
     return 1;
   
@@ -181,6 +227,9 @@ grub_stage2 (void)
   /* Make sure that actual writing is done.  */
   sync ();
 
+  biosdisk_reads = biosdisk_read_sectors = 0;
+  biosdisk_writes = biosdisk_write_sectors = 0;
+
   /* Set our stack, and go for it. */
   simstack = (char *) PROTSTACKINIT;
   doit ();
@@ -193,10 +242,17 @@ grub_stage2 (void)
     endwin ();
 #endif
 
+  if (verbose)
+    printf ("biosdisk: %lu reads (%lu sectors), "
+	    "%lu writes (%lu sectors)\n",
+	    biosdisk_reads, biosdisk_read_sectors,
+	    biosdisk_writes, biosdisk_write_sectors);
+
   /* Close off the file descriptors we used. */
   for (i = 0; i < NUM_DISKS; i ++)
     if (disks[i].flags != -1)
       {
+	unmap_disk_image (i);
 #ifdef __linux__
 	/* In Linux, invalidate the buffer cache. In other OSes, reboot
 	   is one of the solutions...  */
@@ -215,6 +271,12 @@ grub_stage2 (void)
   device_map = 0;
   free (disks);
   disks = 0;
+  free (disk_images);
+  disk_images = 0;
+#ifdef HAVE_SYS_MMAN_H
+  free (mapped_disks);
+  mapped_disks = 0;
+#endif
   free (scratch);
   grub_scratch_mem = 0;
 
@@ -226,6 +288,58 @@ grub_stage2 (void)
   return status;
 }
 
+/* If the device of DRIVE is a regular file, map it into memory, so that
+   biosdisk can read it without copying it through the system calls.
+   If it cannot be mapped, and it is a sparse file, read it through
+   diskimage.c, which skips the holes.  */
+static void
+map_disk_image (int drive)
+{
+#ifdef HAVE_SYS_MMAN_H
+  struct stat st;
+  void *addr;
+
+  if (fstat (disks[drive].flags, &st) || ! S_ISREG (st.st_mode)
+      || st.st_size == 0)
+    return;
+
+  if (st.st_size == (size_t) st.st_size)
+    {
+      addr = mmap (0, st.st_size, PROT_READ, MAP_SHARED,
+		   disks[drive].flags, 0);
+      if (addr != MAP_FAILED)
+	{
+	  mapped_disks[drive].addr = addr;
+	  mapped_disks[drive].size = st.st_size;
+	  mapped_disks[drive].next = 0;
+	  return;
+	}
+    }
+#endif /* HAVE_SYS_MMAN_H */
+
+  /* Too large for our address space probably.  */
+  open_disk_image (disks[drive].flags, 1, &disk_images[drive]);
+}
+
+/* Unmap the disk image of DRIVE, if mapped, and close its format.  */
+static void
+unmap_disk_image (int drive)
+{
+  if (disk_images[drive])
+    {
+      close_disk_image (disk_images[drive]);
+      disk_images[drive] = 0;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+  if (mapped_disks[drive].addr)
+    {
+      munmap (mapped_disks[drive].addr, mapped_disks[drive].size);
+      mapped_disks[drive].addr = 0;
+    }
+#endif /* HAVE_SYS_MMAN_H */
+}
+
 /* Assign DRIVE to a device name DEVICE.  */
 void
 assign_device_name (int drive, const char *device)
@@ -237,6 +351,7 @@ assign_device_name (int drive, const char *device)
   /* If the old one is already opened, close it.  */
   if (disks[drive].flags != -1)
     {
+      unmap_disk_image (drive);
       close (disks[drive].flags);
       disks[drive].flags = -1;
     }
@@ -804,8 +919,24 @@ get_diskinfo (int drive, struct geometry *geometry)
 	  return -1;
 	}
 
-      if (disks[drive].flags != -1)
-	get_drive_geometry (&disks[drive], device_map, drive);
+      /* An image in a format which translates the sectors has the
+	 geometry of its disk, not of the file.  */
+      if (open_disk_image (disks[drive].flags, 0, &disk_images[drive]))
+	{
+	  close (disks[drive].flags);
+	  disks[drive].flags = -1;
+	  assign_device_name (drive, 0);
+	  return -1;
+	}
+
+      if (disk_images[drive])
+	get_image_geometry (&disks[drive], drive,
+			    disk_image_sectors (disk_images[drive]));
+      else
+	{
+	  get_drive_geometry (&disks[drive], device_map, drive);
+	  map_disk_image (drive);
+	}
     }
 
   if (disks[drive].flags == -1)
@@ -813,8 +944,14 @@ get_diskinfo (int drive, struct geometry *geometry)
 
 #ifdef __linux__
   /* In Linux, invalidate the buffer cache, so that left overs
-     from other program in the cache are flushed and seen by us */
-  ioctl (disks[drive].flags, BLKFLSBUF, 0);
+     from other program in the cache are flushed and seen by us. A disk
+     image is a regular file, and it has no such problem.  */
+  if (! disk_images[drive]
+# ifdef HAVE_SYS_MMAN_H
+      && ! mapped_disks[drive].addr
+# endif
+      )
+    ioctl (disks[drive].flags, BLKFLSBUF, 0);
 #endif
 
   *geometry = disks[drive];
@@ -933,6 +1070,77 @@ biosdisk (int subfunc, int drive, struct geometry *geometry,
   if (fd == -1 || fd != disks[drive].flags)
     return BIOSDISK_ERROR_GEOMETRY;
 
+  /* Translate the sectors of a formatted disk image.  */
+  if (disk_images[drive])
+    {
+      buf = (char *) (segment << 4);
+
+      switch (subfunc)
+	{
+	case BIOSDISK_READ:
+	  biosdisk_reads++;
+	  biosdisk_read_sectors += nsec;
+	  if (read_disk_image (disk_images[drive], sector, nsec, buf))
+	    return -1;
+	  break;
+
+	case BIOSDISK_WRITE:
+	  biosdisk_writes++;
+	  biosdisk_write_sectors += nsec;
+	  if (verbose)
+	    {
+	      grub_printf ("Write %d sectors starting from %d sector"
+			   " to drive 0x%x (%s)\n",
+			   nsec, sector, drive, device_map[drive]);
+	      hex_dump (buf, nsec * SECTOR_SIZE);
+	    }
+	  if (! read_only)
+	    if (write_disk_image (disk_images[drive], sector, nsec, buf))
+	      return -1;
+	  break;
+
+	default:
+	  grub_printf ("unknown subfunc %d\n", subfunc);
+	  break;
+	}
+
+      return 0;
+    }
+
+#ifdef HAVE_SYS_MMAN_H
+  /* Read a mapped disk image by copying the sectors directly.  */
+  if (subfunc == BIOSDISK_READ && mapped_disks[drive].addr
+      && sector >= 0 && nsec > 0
+      && ((size_t) sector + nsec <= mapped_disks[drive].size >> SECTOR_BITS))
+    {
+      struct mapped_disk *disk = &mapped_disks[drive];
+      size_t offset = (size_t) sector << SECTOR_BITS;
+      size_t len = (size_t) nsec << SECTOR_BITS;
+
+      biosdisk_reads++;
+      biosdisk_read_sectors += nsec;
+
+# ifdef MADV_WILLNEED
+      /* If the read continues the last one, ask the kernel to read
+	 ahead the data following it.  */
+      if (offset == disk->next && offset + len < disk->size)
+	{
+	  size_t page = getpagesize ();
+	  size_t start = (offset + len) & ~(page - 1);
+	  size_t ahead = MAPPED_DISK_READAHEAD;
+
+	  if (start + ahead > disk->size)
+	    ahead = disk->size - start;
+	  madvise (disk->addr + start, ahead, MADV_WILLNEED);
+	}
+# endif /* MADV_WILLNEED */
+      disk->next = offset + len;
+
+      memcpy ((char *) (segment << 4), disk->addr + offset, len);
+      return 0;
+    }
+#endif /* HAVE_SYS_MMAN_H */
+
   /* Seek to the specified location. */
 #if defined(__linux__) && (!defined(__GLIBC__) || \
 	((__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 1))))
@@ -962,6 +1170,8 @@ biosdisk (int subfunc, int drive, struct geometry *geometry,
   switch (subfunc)
     {
     case BIOSDISK_READ:
+      biosdisk_reads++;
+      biosdisk_read_sectors += nsec;
 #ifdef __linux__
       if (sector == 0 && nsec > 1)
 	{
@@ -980,6 +1190,8 @@ biosdisk (int subfunc, int drive, struct geometry *geometry,
       break;
 
     case BIOSDISK_WRITE:
+      biosdisk_writes++;
+      biosdisk_write_sectors += nsec;
       if (verbose)
 	{
 	  grub_printf ("Write %d sectors starting from %d sector"
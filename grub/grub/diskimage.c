@@ -0,0 +1,785 @@
+/* diskimage.c - the disk image formats for the grub shell */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2005  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* A BIOS drive of the grub shell may be a disk image in a format which
+   doesn't store the sectors as they are. biosdisk in asmstub.c passes
+   the accesses to such a drive to the functions below, which translate
+   them into the accesses to the image file. Two formats are supported:
+
+   - qcow2, the format of QEMU. The sectors are stored in clusters,
+     which are looked up through a two-level table. Only the clusters
+     which have been written are allocated in the file.
+
+   - Sparse raw files. The sectors are stored as they are, but the
+     holes of the file are found by SEEK_DATA and SEEK_HOLE, and they
+     are filled with zeros without reading them.
+
+   Plain raw files and devices are not handled here.  */
+
+/* Try to use glibc's transparant LFS support. */
+#define _LARGEFILE_SOURCE	1
+/* lseek becomes synonymous with lseek64.  */
+#define _FILE_OFFSET_BITS	64
+/* SEEK_DATA and SEEK_HOLE.  */
+#define _GNU_SOURCE		1
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* We want to prevent any circularararity in our stubs, as well as
+   libc name clashes. */
+#define WITHOUT_LIBC_STUBS 1
+#include <shared.h>
+#include <device.h>
+
+/* An image format.  */
+struct disk_image_format
+{
+  /* The name of the format.  */
+  const char *name;
+  /* Non-zero if the format stores the sectors as they are.  */
+  int raw;
+  /* Check if the file of IMAGE is in this format, and initialize IMAGE
+     if so. Return 1 if it is, 0 if not, or -1 if it is but cannot be
+     used.  */
+  int (*open) (struct disk_image *image);
+  /* Read or write LEN bytes at OFFSET of the disk. Return zero if
+     successful, otherwise -1.  */
+  int (*read) (struct disk_image *image, unsigned long long offset,
+	       char *buf, size_t len);
+  int (*write) (struct disk_image *image, unsigned long long offset,
+		const char *buf, size_t len);
+  /* Release the resources of IMAGE.  */
+  void (*close) (struct disk_image *image);
+};
+
+/* The number of L2 tables cached for a qcow2 image.  */
+#define QCOW2_L2_CACHE_SIZE	16
+
+struct disk_image
+{
+  const struct disk_image_format *format;
+  int fd;
+  /* The size of the disk in bytes.  */
+  unsigned long long size;
+
+  /* The rest is used only by qcow2.  */
+  int version;
+  int cluster_bits;
+  /* The number of the entries in a L2 table is 1 << L2_BITS.  */
+  int l2_bits;
+  /* Non-zero if the image may be written.  */
+  int writable;
+  /* The L1 table, in the host byte order.  */
+  unsigned long long *l1_table;
+  unsigned long l1_size;
+  unsigned long long l1_offset;
+  unsigned long long refcount_table_offset;
+  unsigned long refcount_table_size;
+  unsigned long long autoclear_features;
+  /* The end of the file, where new clusters are allocated.  */
+  unsigned long long file_end;
+  /* The cached L2 tables, kept in the byte order of the file.  */
+  struct
+  {
+    unsigned long long offset;
+    unsigned long long *table;
+    unsigned long used;
+  } l2_cache[QCOW2_L2_CACHE_SIZE];
+  unsigned long l2_clock;
+};
+
+/* Read or write LEN bytes at OFFSET of FD. Return zero if successful,
+   otherwise -1.  */
+static int
+pread_all (int fd, void *buf, size_t len, unsigned long long offset)
+{
+  char *p = buf;
+
+  while (len)
+    {
+      ssize_t ret = pread (fd, p, len, offset);
+
+      if (ret <= 0)
+	{
+	  if (ret < 0 && errno == EINTR)
+	    continue;
+	  return -1;
+	}
+
+      p += ret;
+      len -= ret;
+      offset += ret;
+    }
+
+  return 0;
+}
+
+static int
+pwrite_all (int fd, const void *buf, size_t len, unsigned long long offset)
+{
+  const char *p = buf;
+
+  while (len)
+    {
+      ssize_t ret = pwrite (fd, p, len, offset);
+
+      if (ret <= 0)
+	{
+	  if (ret < 0 && errno == EINTR)
+	    continue;
+	  return -1;
+	}
+
+      p += ret;
+      len -= ret;
+      offset += ret;
+    }
+
+  return 0;
+}
+
+
+/* qcow2.  */
+
+#define QCOW2_MAGIC		0x514649fb	/* "QFI\xfb" */
+#define QCOW2_HEADER_SIZE	104
+
+/* The fields of the header.  */
+#define QCOW2_VERSION		4
+#define QCOW2_BACKING_FILE	8
+#define QCOW2_CLUSTER_BITS	20
+#define QCOW2_SIZE		24
+#define QCOW2_CRYPT_METHOD	32
+#define QCOW2_L1_SIZE		36
+#define QCOW2_L1_OFFSET		40
+#define QCOW2_REFCOUNT_OFFSET	48
+#define QCOW2_REFCOUNT_CLUSTERS	56
+#define QCOW2_NB_SNAPSHOTS	60
+#define QCOW2_INCOMPAT_FEATURES	72
+#define QCOW2_AUTOCLEAR_FEATURES	88
+#define QCOW2_REFCOUNT_ORDER	96
+
+/* The incompatible features.  */
+#define QCOW2_INCOMPAT_DIRTY	(1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT	(1ULL << 1)
+
+/* The bits of the entries of the tables.  */
+#define QCOW2_OFLAG_COPIED	(1ULL << 63)
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)
+#define QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+
+static unsigned long
+get_be32 (const unsigned char *p)
+{
+  return ((unsigned long) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long long
+get_be64 (const unsigned char *p)
+{
+  return ((unsigned long long) get_be32 (p) << 32) | get_be32 (p + 4);
+}
+
+static void
+put_be64 (unsigned char *p, unsigned long long val)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    {
+      p[i] = val & 0xff;
+      val >>= 8;
+    }
+}
+
+static int
+qcow2_open (struct disk_image *image)
+{
+  unsigned char header[QCOW2_HEADER_SIZE];
+  unsigned long long incompat = 0;
+  int refcount_order = 4;
+  struct stat st;
+  unsigned long i;
+
+  if (pread_all (image->fd, header, 72, 0)
+      || get_be32 (header) != QCOW2_MAGIC)
+    return 0;
+
+  image->version = get_be32 (header + QCOW2_VERSION);
+  if (image->version == 3)
+    {
+      if (pread_all (image->fd, header + 72, QCOW2_HEADER_SIZE - 72, 72))
+	return -1;
+      incompat = get_be64 (header + QCOW2_INCOMPAT_FEATURES);
+      image->autoclear_features = get_be64 (header
+					    + QCOW2_AUTOCLEAR_FEATURES);
+      refcount_order = get_be32 (header + QCOW2_REFCOUNT_ORDER);
+    }
+  else if (image->version != 2)
+    return -1;
+
+  /* Encrypted images, backing files, and any feature we don't know
+     are not supported.  */
+  if (get_be32 (header + QCOW2_CRYPT_METHOD)
+      || get_be64 (header + QCOW2_BACKING_FILE)
+      || (incompat & ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_CORRUPT))
+      || (incompat & QCOW2_INCOMPAT_CORRUPT))
+    return -1;
+
+  image->cluster_bits = get_be32 (header + QCOW2_CLUSTER_BITS);
+  if (image->cluster_bits < 9 || image->cluster_bits > 21)
+    return -1;
+  image->l2_bits = image->cluster_bits - 3;
+
+  image->size = get_be64 (header + QCOW2_SIZE);
+  image->l1_size = get_be32 (header + QCOW2_L1_SIZE);
+  image->l1_offset = get_be64 (header + QCOW2_L1_OFFSET);
+  image->refcount_table_offset = get_be64 (header + QCOW2_REFCOUNT_OFFSET);
+  image->refcount_table_size
+    = (get_be32 (header + QCOW2_REFCOUNT_CLUSTERS)
+       << (image->cluster_bits - 3));
+  if (image->l1_size > 0x2000000)
+    return -1;
+
+  /* Allocating new clusters updates the refcounts, which is done only
+     for 16-bit refcounts. If an image has snapshots, clusters may be
+     shared, and writing them would need copying them. If the refcounts
+     are dirty, they cannot be updated safely.  */
+  image->writable = (refcount_order == 4
+		     && get_be32 (header + QCOW2_NB_SNAPSHOTS) == 0
+		     && ! (incompat & QCOW2_INCOMPAT_DIRTY));
+
+  if (fstat (image->fd, &st))
+    return -1;
+  image->file_end = ((st.st_size + (1ULL << image->cluster_bits) - 1)
+		     & ~((1ULL << image->cluster_bits) - 1));
+
+  image->l1_table = malloc ((image->l1_size + 1) * sizeof (*image->l1_table));
+  if (! image->l1_table)
+    return -1;
+  if (pread_all (image->fd, image->l1_table,
+		 image->l1_size * sizeof (*image->l1_table), image->l1_offset))
+    {
+      free (image->l1_table);
+      return -1;
+    }
+  for (i = 0; i < image->l1_size; i++)
+    image->l1_table[i]
+      = get_be64 ((unsigned char *) (image->l1_table + i));
+
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+    {
+      image->l2_cache[i].offset = 0;
+      image->l2_cache[i].table = 0;
+      image->l2_cache[i].used = 0;
+    }
+  image->l2_clock = 0;
+
+  return 1;
+}
+
+static void
+qcow2_close (struct disk_image *image)
+{
+  int i;
+
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+    free (image->l2_cache[i].table);
+  free (image->l1_table);
+}
+
+/* Get the L2 table at OFFSET of IMAGE from the cache, reading it if
+   necessary. If ZERO is non-zero, the table is a new one, so fill it with
+   zeros instead of reading it. Return zero if it fails.  */
+static unsigned long long *
+qcow2_get_l2_table (struct disk_image *image, unsigned long long offset,
+		    int zero)
+{
+  size_t size = (size_t) 1 << image->cluster_bits;
+  int i, victim = 0;
+
+  for (i = 0; i < QCOW2_L2_CACHE_SIZE; i++)
+    {
+      if (image->l2_cache[i].table && image->l2_cache[i].offset == offset)
+	{
+	  image->l2_cache[i].used = ++image->l2_clock;
+	  return image->l2_cache[i].table;
+	}
+
+      if (image->l2_cache[i].used < image->l2_cache[victim].used)
+	victim = i;
+    }
+
+  if (! image->l2_cache[victim].table)
+    {
+      image->l2_cache[victim].table = malloc (size);
+      if (! image->l2_cache[victim].table)
+	return 0;
+    }
+
+  /* Invalidate the slot first, in case that the read fails.  */
+  image->l2_cache[victim].used = 0;
+  image->l2_cache[victim].offset = 0;
+  if (zero)
+    memset (image->l2_cache[victim].table, 0, size);
+  else if (pread_all (image->fd, image->l2_cache[victim].table, size, offset))
+    return 0;
+
+  image->l2_cache[victim].offset = offset;
+  image->l2_cache[victim].used = ++image->l2_clock;
+  return image->l2_cache[victim].table;
+}
+
+/* Write zeros to the cluster at OFFSET of IMAGE.  */
+static int
+qcow2_zero_cluster (struct disk_image *image, unsigned long long offset)
+{
+  size_t size = (size_t) 1 << image->cluster_bits;
+  char *zeros = calloc (1, size);
+  int ret;
+
+  if (! zeros)
+    return -1;
+  ret = pwrite_all (image->fd, zeros, size, offset);
+  free (zeros);
+  return ret;
+}
+
+/* Set the refcount of the cluster at OFFSET of IMAGE to one.  */
+static int
+qcow2_set_refcount (struct disk_image *image, unsigned long long offset)
+{
+  unsigned long long cluster = offset >> image->cluster_bits;
+  /* The number of the 16-bit refcounts in a refcount block.  */
+  int block_bits = image->cluster_bits - 1;
+  unsigned long long index = cluster >> block_bits;
+  unsigned char entry[8];
+  unsigned long long block;
+  static const unsigned char one[2] = { 0, 1 };
+
+  /* Growing the refcount table is not supported, but a table of one
+     cluster covers terabytes anyway.  */
+  if (index >= image->refcount_table_size)
+    return -1;
+
+  if (pread_all (image->fd, entry, 8,
+		 image->refcount_table_offset + index * 8))
+    return -1;
+
+  block = get_be64 (entry) & QCOW2_OFFSET_MASK;
+  if (! block)
+    {
+      /* Allocate a new refcount block, and count it in itself or in
+	 another block.  */
+      block = image->file_end;
+      image->file_end += 1ULL << image->cluster_bits;
+      if (qcow2_zero_cluster (image, block))
+	return -1;
+
+      put_be64 (entry, block);
+      if (pwrite_all (image->fd, entry, 8,
+		      image->refcount_table_offset + index * 8)
+	  || qcow2_set_refcount (image, block))
+	return -1;
+    }
+
+  return pwrite_all (image->fd, one, 2,
+		     block + ((cluster & ((1ULL << block_bits) - 1)) << 1));
+}
+
+/* Allocate a new cluster filled with zeros in IMAGE, and return the
+   offset in the file, or zero if it fails.  */
+static unsigned long long
+qcow2_alloc_cluster (struct disk_image *image)
+{
+  unsigned long long offset = image->file_end;
+
+  image->file_end += 1ULL << image->cluster_bits;
+  if (qcow2_zero_cluster (image, offset)
+      || qcow2_set_refcount (image, offset))
+    return 0;
+
+  return offset;
+}
+
+/* Clear the autoclear features before IMAGE is modified first, since
+   we don't maintain any of them.  */
+static int
+qcow2_clear_autoclear (struct disk_image *image)
+{
+  unsigned char zeros[8];
+
+  if (image->version < 3 || ! image->autoclear_features)
+    return 0;
+
+  memset (zeros, 0, sizeof (zeros));
+  if (pwrite_all (image->fd, zeros, 8, QCOW2_AUTOCLEAR_FEATURES))
+    return -1;
+
+  image->autoclear_features = 0;
+  return 0;
+}
+
+/* Find the cluster which contains OFFSET of the disk of IMAGE. If ALLOC
+   is non-zero, allocate it if it is not allocated yet. Store the offset
+   of the cluster in the file in *HOST, or zero if it reads as zeros.
+   Return zero if successful, otherwise -1.  */
+static int
+qcow2_map (struct disk_image *image, unsigned long long offset, int alloc,
+	   unsigned long long *host)
+{
+  unsigned long l1_index = offset >> (image->l2_bits + image->cluster_bits);
+  unsigned long l2_index = ((offset >> image->cluster_bits)
+			    & ((1UL << image->l2_bits) - 1));
+  unsigned long long l2_offset, entry, cluster;
+  unsigned long long *table;
+  unsigned char buf[8];
+
+  *host = 0;
+  if (l1_index >= image->l1_size)
+    return alloc ? -1 : 0;
+
+  l2_offset = image->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+  if (! l2_offset)
+    {
+      if (! alloc)
+	return 0;
+
+      if (qcow2_clear_autoclear (image))
+	return -1;
+
+      l2_offset = qcow2_alloc_cluster (image);
+      if (! l2_offset)
+	return -1;
+
+      put_be64 (buf, l2_offset | QCOW2_OFLAG_COPIED);
+      if (pwrite_all (image->fd, buf, 8, image->l1_offset + l1_index * 8))
+	return -1;
+      image->l1_table[l1_index] = l2_offset | QCOW2_OFLAG_COPIED;
+
+      table = qcow2_get_l2_table (image, l2_offset, 1);
+    }
+  else
+    table = qcow2_get_l2_table (image, l2_offset, 0);
+
+  if (! table)
+    return -1;
+
+  entry = get_be64 ((unsigned char *) (table + l2_index));
+  /* Compressed clusters are not supported.  */
+  if (entry & QCOW2_OFLAG_COMPRESSED)
+    return -1;
+
+  cluster = entry & QCOW2_OFFSET_MASK;
+  if (cluster && ! (image->version >= 3 && (entry & QCOW2_OFLAG_ZERO)))
+    {
+      *host = cluster;
+      return 0;
+    }
+
+  if (! alloc)
+    return 0;
+
+  if (qcow2_clear_autoclear (image))
+    return -1;
+
+  /* A zero cluster may have a preallocated cluster, so use it.  */
+  if (cluster)
+    {
+      if (qcow2_zero_cluster (image, cluster))
+	return -1;
+    }
+  else
+    {
+      cluster = qcow2_alloc_cluster (image);
+      if (! cluster)
+	return -1;
+    }
+
+  put_be64 ((unsigned char *) (table + l2_index),
+	    cluster | QCOW2_OFLAG_COPIED);
+  if (pwrite_all (image->fd, table + l2_index, 8, l2_offset + l2_index * 8))
+    return -1;
+
+  *host = cluster;
+  return 0;
+}
+
+static int
+qcow2_read (struct disk_image *image, unsigned long long offset,
+	    char *buf, size_t len)
+{
+  size_t cluster_size = (size_t) 1 << image->cluster_bits;
+
+  while (len)
+    {
+      size_t start = offset & (cluster_size - 1);
+      size_t size = cluster_size - start;
+      unsigned long long host;
+
+      if (size > len)
+	size = len;
+
+      if (qcow2_map (image, offset, 0, &host))
+	return -1;
+
+      if (! host)
+	memset (buf, 0, size);
+      else if (pread_all (image->fd, buf, size, host + start))
+	return -1;
+
+      offset += size;
+      buf += size;
+      len -= size;
+    }
+
+  return 0;
+}
+
+static int
+qcow2_write (struct disk_image *image, unsigned long long offset,
+	     const char *buf, size_t len)
+{
+  size_t cluster_size = (size_t) 1 << image->cluster_bits;
+
+  if (! image->writable)
+    return -1;
+
+  while (len)
+    {
+      size_t start = offset & (cluster_size - 1);
+      size_t size = cluster_size - start;
+      unsigned long long host;
+
+      if (size > len)
+	size = len;
+
+      if (qcow2_map (image, offset, 1, &host)
+	  || pwrite_all (image->fd, buf, size, host + start))
+	return -1;
+
+      offset += size;
+      buf += size;
+      len -= size;
+    }
+
+  return 0;
+}
+
+
+/* Sparse raw files.  */
+
+static int
+sparse_open (struct disk_image *image)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  struct stat st;
+
+  if (fstat (image->fd, &st) || ! S_ISREG (st.st_mode)
+      || (unsigned long long) st.st_blocks * 512 >= st.st_size)
+    return 0;
+
+  /* Check if the filesystem knows where the holes are.  */
+  if (lseek (image->fd, 0, SEEK_HOLE) < 0)
+    return 0;
+
+  image->size = st.st_size;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+static int
+sparse_read (struct disk_image *image, unsigned long long offset,
+	     char *buf, size_t len)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+  unsigned long long end = offset + len;
+
+  while (offset < end)
+    {
+      off_t data, hole;
+
+      data = lseek (image->fd, offset, SEEK_DATA);
+      if (data < 0)
+	{
+	  /* ENXIO means that the rest is a hole.  */
+	  if (errno != ENXIO)
+	    return -1;
+	  data = end;
+	}
+
+      if ((unsigned long long) data > offset)
+	{
+	  size_t size = ((unsigned long long) data < end
+			 ? data - offset : end - offset);
+
+	  memset (buf, 0, size);
+	  buf += size;
+	  offset += size;
+	  if (offset == end)
+	    break;
+	}
+
+      hole = lseek (image->fd, offset, SEEK_HOLE);
+      if (hole < 0)
+	return -1;
+      if ((unsigned long long) hole > end)
+	hole = end;
+
+      if (pread_all (image->fd, buf, hole - offset, offset))
+	return -1;
+      buf += hole - offset;
+      offset = hole;
+    }
+
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+static int
+sparse_write (struct disk_image *image, unsigned long long offset,
+	      const char *buf, size_t len)
+{
+  return pwrite_all (image->fd, buf, len, offset);
+}
+
+static void
+sparse_close (struct disk_image *image)
+{
+}
+
+
+/* The formats in the order of probing.  */
+static const struct disk_image_format formats[] =
+{
+  {"qcow2", 0, qcow2_open, qcow2_read, qcow2_write, qcow2_close},
+  {"sparse", 1, sparse_open, sparse_read, sparse_write, sparse_close},
+  {0, 0, 0, 0, 0, 0}
+};
+
+/* Check the format of the image file FD, and set *IMAGE to a new image
+   if it is in one of the formats above, otherwise zero. Raw formats are
+   checked only if ALLOW_RAW is non-zero. Return -1 if the format of the
+   file is known but it cannot be used, otherwise zero.  */
+int
+open_disk_image (int fd, int allow_raw, struct disk_image **image)
+{
+  const struct disk_image_format *format;
+  struct disk_image *new;
+
+  *image = 0;
+
+  new = malloc (sizeof (*new));
+  if (! new)
+    return 0;
+
+  for (format = formats; format->name; format++)
+    {
+      int ret;
+
+      if (format->raw && ! allow_raw)
+	continue;
+
+      memset (new, 0, sizeof (*new));
+      new->format = format;
+      new->fd = fd;
+
+      ret = format->open (new);
+      if (ret > 0)
+	{
+	  if (verbose)
+	    grub_printf ("Use the %s image of %u sectors\n",
+			 format->name, (int) disk_image_sectors (new));
+	  *image = new;
+	  return 0;
+	}
+
+      if (ret < 0)
+	{
+	  if (verbose)
+	    grub_printf ("The %s image is not supported\n", format->name);
+	  free (new);
+	  return -1;
+	}
+    }
+
+  free (new);
+  return 0;
+}
+
+void
+close_disk_image (struct disk_image *image)
+{
+  image->format->close (image);
+  free (image);
+}
+
+/* Return the size of the disk of IMAGE in sectors.  */
+unsigned long
+disk_image_sectors (struct disk_image *image)
+{
+  unsigned long long sectors = image->size >> SECTOR_BITS;
+
+  /* The geometry cannot express more.  */
+  if (sectors > 0xffffffffUL)
+    sectors = 0xffffffffUL;
+
+  return sectors;
+}
+
+/* Read or write NSEC sectors from SECTOR of the disk of IMAGE. Return
+   zero if successful, otherwise -1.  */
+int
+read_disk_image (struct disk_image *image, unsigned long sector, int nsec,
+		 char *buf)
+{
+  unsigned long long offset = (unsigned long long) sector << SECTOR_BITS;
+  size_t len = (size_t) nsec << SECTOR_BITS;
+
+  if (offset + len > image->size)
+    return -1;
+
+  return image->format->read (image, offset, buf, len);
+}
+
+int
+write_disk_image (struct disk_image *image, unsigned long sector, int nsec,
+		  const char *buf)
+{
+  unsigned long long offset = (unsigned long long) sector << SECTOR_BITS;
+  size_t len = (size_t) nsec << SECTOR_BITS;
+
+  if (offset + len > image->size)
+    return -1;
+
+  return image->format->write (image, offset, buf, len);
+}
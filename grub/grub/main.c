@@ -65,6 +65,7 @@ static char *default_config_file;
 #define OPT_DEVICE_MAP		-15
 #define OPT_PRESET_MENU		-16
 #define OPT_NO_PAGER		-17
+#define OPT_NET_DEVICE		-18
 #define OPTSTRING ""
 
 static struct option longopts[] =
@@ -76,6 +77,9 @@ static struct option longopts[] =
   {"help", no_argument, 0, OPT_HELP},
   {"hold", optional_argument, 0, OPT_HOLD},
   {"install-partition", required_argument, 0, OPT_INSTALL_PARTITION},
+#ifdef SUPPORT_NETBOOT
+  {"net-device", required_argument, 0, OPT_NET_DEVICE},
+#endif /* SUPPORT_NETBOOT */
   {"no-config-file", no_argument, 0, OPT_NO_CONFIG_FILE},
   {"no-curses", no_argument, 0, OPT_NO_CURSES},
   {"no-floppy", no_argument, 0, OPT_NO_FLOPPY},
@@ -107,6 +111,14 @@ Enter the GRand Unified Bootloader command shell.\n\
     --help                   display this message and exit\n\
     --hold                   wait until a debugger will attach\n\
     --install-partition=PAR  specify stage2 install_partition [default=0x%x]\n\
+"
+#ifdef SUPPORT_NETBOOT
+	    "\
+    --net-device=DEV         emulate a network card with DEV, which is\n\
+                             either tap:IFNAME or dir:DIRECTORY\n\
+"
+#endif /* SUPPORT_NETBOOT */
+	    "\
     --no-config-file         do not use the config file\n\
     --no-curses              do not use curses\n\
     --no-floppy              do not probe any floppy drive\n\
@@ -236,6 +248,12 @@ main (int argc, char **argv)
 	case OPT_PRESET_MENU:
 	  use_preset_menu = 1;
 	  break;
+
+#ifdef SUPPORT_NETBOOT
+	case OPT_NET_DEVICE:
+	  net_device = strdup (optarg);
+	  break;
+#endif /* SUPPORT_NETBOOT */
 	  
 	default:
 	  usage (1);
@@ -0,0 +1,695 @@
+/* netstub.c - the emulated network for the grub shell */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2005  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* The "hostnic" driver in netboot/hostnic.c passes ethernet frames to
+   the functions below. Depending on the option --net-device, the
+   frames go either to a TAP interface of the host (tap:NAME), or
+   through a pair of AF_UNIX datagram sockets to a tiny ARP, BOOTP/DHCP
+   and TFTP server in this process, which serves the files under a
+   directory of the host (dir:DIRECTORY). The latter doesn't need any
+   privilege, so it is handy to test and measure the netboot code.  */
+
+/* Try to use glibc's transparant LFS support. */
+#define _LARGEFILE_SOURCE	1
+/* lseek becomes synonymous with lseek64.  */
+#define _FILE_OFFSET_BITS	64
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+# include <sys/ioctl.h>		/* ioctl */
+# include <net/if.h>		/* struct ifreq */
+# include <linux/if_tun.h>	/* TUNSETIFF */
+#endif /* __linux__ */
+
+/* We want to prevent any circularararity in our stubs, as well as
+   libc name clashes. */
+#define WITHOUT_LIBC_STUBS 1
+#include <shared.h>
+
+#ifdef SUPPORT_NETBOOT
+
+/* The specification of the network device, set by --net-device.  */
+char *net_device = 0;
+
+/* The file descriptor which the client side reads and writes.  */
+static int net_fd = -1;
+
+/* The file descriptor of the built-in server, or -1 if a TAP device
+   is used.  */
+static int server_fd = -1;
+
+/* The directory served by the built-in TFTP server.  */
+static char *server_root = 0;
+
+/* The statistics, reported in verbose mode.  */
+static unsigned long net_tx_frames, net_tx_bytes;
+static unsigned long net_rx_frames, net_rx_bytes;
+
+/* The fixed addresses of the emulated network. These are the same as
+   the ones of the user mode network in QEMU.  */
+static const unsigned char client_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
+static const unsigned char server_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x35, 0x02};
+static const unsigned char client_ip[4] = {10, 0, 2, 15};
+static const unsigned char server_ip[4] = {10, 0, 2, 2};
+static const unsigned char netmask_ip[4] = {255, 255, 255, 0};
+
+/* The layout of a frame.  */
+#define FRAME_MAX	1514
+#define ETH_HDR		14
+#define IP_HDR		20
+#define UDP_HDR		8
+#define UDP_DATA	(ETH_HDR + IP_HDR + UDP_HDR)
+
+/* BOOTP and TFTP.  */
+#define BOOTP_SERVER_PORT	67
+#define BOOTP_CLIENT_PORT	68
+#define BOOTP_FIXED_LEN		236
+#define DHCP_OPTIONS_LEN	312
+#define TFTP_PORT		69
+#define TFTP_MAX_BLKSIZE	(FRAME_MAX - UDP_DATA - 4)
+
+/* The state of the TFTP transfer. Only one transfer is served at a
+   time, like the client does.  */
+static struct
+{
+  int fd;
+  unsigned long size;
+  unsigned short client_port;
+  unsigned short server_port;
+  unsigned int blksize;
+  unsigned short block;
+  unsigned long offset;
+  unsigned int len;
+  int oack;
+} tftp = {-1};
+
+static unsigned short tftp_next_port = 32768;
+
+static unsigned int
+get16 (const unsigned char *p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static void
+put16 (unsigned char *p, unsigned int v)
+{
+  p[0] = (v >> 8) & 0xff;
+  p[1] = v & 0xff;
+}
+
+/* Add LEN bytes at P to the one's complement sum SUM.  */
+static unsigned long
+csum_add (unsigned long sum, const unsigned char *p, int len)
+{
+  while (len > 1)
+    {
+      sum += (p[0] << 8) | p[1];
+      p += 2;
+      len -= 2;
+    }
+
+  if (len)
+    sum += p[0] << 8;
+
+  return sum;
+}
+
+static unsigned int
+csum_fold (unsigned long sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+
+  return ~sum & 0xffff;
+}
+
+/* Send the frame FRAME whose length is LEN from the server.  */
+static void
+server_send (unsigned char *frame, int len)
+{
+  /* Drop the frame if the client doesn't read, as a real network
+     would do.  */
+  send (server_fd, frame, len, MSG_DONTWAIT);
+}
+
+/* Send the UDP datagram PAYLOAD whose length is LEN from the server
+   port SPORT to the port DPORT at DST_IP and DST_MAC. The payload must
+   be placed at UDP_DATA in FRAME.  */
+static void
+server_send_udp (unsigned char *frame, const unsigned char *dst_mac,
+		 const unsigned char *dst_ip, unsigned int sport,
+		 unsigned int dport, int len)
+{
+  unsigned char *ip = frame + ETH_HDR;
+  unsigned char *udp = ip + IP_HDR;
+  unsigned long sum;
+
+  memcpy (frame, dst_mac, 6);
+  memcpy (frame + 6, server_mac, 6);
+  put16 (frame + 12, 0x0800);
+
+  ip[0] = 0x45;
+  ip[1] = 0;
+  put16 (ip + 2, IP_HDR + UDP_HDR + len);
+  put16 (ip + 4, 0);
+  put16 (ip + 6, 0);
+  ip[8] = 64;
+  ip[9] = 17;
+  put16 (ip + 10, 0);
+  memcpy (ip + 12, server_ip, 4);
+  memcpy (ip + 16, dst_ip, 4);
+  put16 (ip + 10, csum_fold (csum_add (0, ip, IP_HDR)));
+
+  put16 (udp, sport);
+  put16 (udp + 2, dport);
+  put16 (udp + 4, UDP_HDR + len);
+  put16 (udp + 6, 0);
+
+  /* The pseudo header and the datagram.  */
+  sum = csum_add (0, ip + 12, 8);
+  sum += 17 + UDP_HDR + len;
+  sum = csum_add (sum, udp, UDP_HDR + len);
+  sum = csum_fold (sum);
+  put16 (udp + 6, sum ? sum : 0xffff);
+
+  server_send (frame, UDP_DATA + len);
+}
+
+/* Answer an ARP request for the server.  */
+static void
+server_arp (const unsigned char *req, int len)
+{
+  unsigned char frame[ETH_HDR + 28];
+  unsigned char *arp = frame + ETH_HDR;
+
+  if (len < ETH_HDR + 28)
+    return;
+
+  /* Only requests for the server address.  */
+  if (get16 (req + ETH_HDR + 6) != 1
+      || memcmp (req + ETH_HDR + 24, server_ip, 4) != 0)
+    return;
+
+  memcpy (frame, req + ETH_HDR + 8, 6);
+  memcpy (frame + 6, server_mac, 6);
+  put16 (frame + 12, 0x0806);
+
+  memcpy (arp, req + ETH_HDR, 6);
+  put16 (arp + 6, 2);
+  memcpy (arp + 8, server_mac, 6);
+  memcpy (arp + 14, server_ip, 4);
+  memcpy (arp + 18, req + ETH_HDR + 8, 10);
+
+  server_send (frame, sizeof (frame));
+}
+
+/* Answer a BOOTP request or a DHCP discover/request.  */
+static void
+server_bootp (const unsigned char *req, int len)
+{
+  const unsigned char *bp = req + UDP_DATA;
+  unsigned char frame[UDP_DATA + BOOTP_FIXED_LEN + DHCP_OPTIONS_LEN];
+  unsigned char *rp = frame + UDP_DATA;
+  unsigned char *opt;
+  int msg_type = 0;
+
+  if (len < UDP_DATA + BOOTP_FIXED_LEN || bp[0] != 1)
+    return;
+
+  /* Look for the DHCP message type.  */
+  if (len >= UDP_DATA + BOOTP_FIXED_LEN + 4
+      && bp[236] == 99 && bp[237] == 130 && bp[238] == 83 && bp[239] == 99)
+    {
+      const unsigned char *p = bp + BOOTP_FIXED_LEN + 4;
+      const unsigned char *end = req + len;
+
+      while (p < end && *p != 255)
+	{
+	  if (*p == 0)
+	    {
+	      p++;
+	      continue;
+	    }
+
+	  if (p + 2 > end || p + 2 + p[1] > end)
+	    break;
+
+	  if (*p == 53 && p[1] >= 1)
+	    msg_type = p[2];
+
+	  p += 2 + p[1];
+	}
+    }
+
+  /* DHCPDISCOVER is answered by DHCPOFFER, and DHCPREQUEST by DHCPACK.
+     Plain BOOTP gets a reply without any DHCP option.  */
+  if (msg_type == 1)
+    msg_type = 2;
+  else if (msg_type == 3)
+    msg_type = 5;
+  else if (msg_type)
+    return;
+
+  memset (rp, 0, BOOTP_FIXED_LEN + DHCP_OPTIONS_LEN);
+  rp[0] = 2;
+  rp[1] = bp[1];
+  rp[2] = bp[2];
+  memcpy (rp + 4, bp + 4, 4);
+  memcpy (rp + 16, client_ip, 4);
+  memcpy (rp + 20, server_ip, 4);
+  memcpy (rp + 28, bp + 28, 16);
+  strcpy ((char *) rp + 44, "grub");
+
+  opt = rp + BOOTP_FIXED_LEN;
+  *opt++ = 99;
+  *opt++ = 130;
+  *opt++ = 83;
+  *opt++ = 99;
+  if (msg_type)
+    {
+      *opt++ = 53;
+      *opt++ = 1;
+      *opt++ = msg_type;
+      *opt++ = 54;
+      *opt++ = 4;
+      memcpy (opt, server_ip, 4);
+      opt += 4;
+      /* One day.  */
+      *opt++ = 51;
+      *opt++ = 4;
+      *opt++ = 0;
+      *opt++ = 1;
+      *opt++ = 0x51;
+      *opt++ = 0x80;
+    }
+  *opt++ = 1;
+  *opt++ = 4;
+  memcpy (opt, netmask_ip, 4);
+  opt += 4;
+  *opt = 255;
+
+  server_send_udp (frame, req + 6, client_ip, BOOTP_SERVER_PORT,
+		   BOOTP_CLIENT_PORT, BOOTP_FIXED_LEN + DHCP_OPTIONS_LEN);
+}
+
+static void
+tftp_finish (void)
+{
+  if (tftp.fd >= 0)
+    close (tftp.fd);
+
+  tftp.fd = -1;
+}
+
+/* Send the TFTP error CODE with the message MSG to the port PORT.  */
+static void
+tftp_send_error (const unsigned char *req, unsigned int sport,
+		 unsigned int port, int code, const char *msg)
+{
+  unsigned char frame[UDP_DATA + 4 + 128];
+  unsigned char *tp = frame + UDP_DATA;
+  int len;
+
+  put16 (tp, 5);
+  put16 (tp + 2, code);
+  len = strlen (msg);
+  memcpy (tp + 4, msg, len + 1);
+  server_send_udp (frame, req + 6, req + ETH_HDR + 12, sport, port,
+		   4 + len + 1);
+}
+
+/* Send the current block of the transfer.  */
+static void
+tftp_send_data (const unsigned char *req)
+{
+  unsigned char frame[FRAME_MAX];
+  unsigned char *tp = frame + UDP_DATA;
+  ssize_t len;
+
+  len = pread (tftp.fd, tp + 4, tftp.blksize, tftp.offset);
+  if (len < 0)
+    {
+      tftp_send_error (req, tftp.server_port, tftp.client_port, 0,
+		       strerror (errno));
+      tftp_finish ();
+      return;
+    }
+
+  tftp.len = len;
+  put16 (tp, 3);
+  put16 (tp + 2, tftp.block);
+  server_send_udp (frame, req + 6, req + ETH_HDR + 12, tftp.server_port,
+		   tftp.client_port, 4 + len);
+}
+
+/* Start a new transfer for the read request REQ.  */
+static void
+tftp_rrq (const unsigned char *req, int len)
+{
+  const char *p = (const char *) req + UDP_DATA + 2;
+  const char *end = (const char *) req + len;
+  const char *name;
+  char *path;
+  struct stat st;
+  unsigned char frame[UDP_DATA + 2 + 64];
+  unsigned char *oack = frame + UDP_DATA + 2;
+  int want_blksize = 0, want_tsize = 0;
+  unsigned int port = get16 (req + ETH_HDR + IP_HDR);
+
+  /* Any previous transfer is abandoned.  */
+  tftp_finish ();
+
+  name = p;
+  if (! memchr (p, 0, end - p))
+    return;
+  p += strlen (p) + 1;
+
+  /* Skip the mode, which must be "octet".  */
+  if (p >= end || ! memchr (p, 0, end - p))
+    return;
+  p += strlen (p) + 1;
+
+  tftp.blksize = 512;
+  while (p < end && memchr (p, 0, end - p))
+    {
+      const char *opt = p;
+      const char *val;
+
+      p += strlen (p) + 1;
+      if (p >= end || ! memchr (p, 0, end - p))
+	break;
+      val = p;
+      p += strlen (p) + 1;
+
+      if (strcasecmp (opt, "blksize") == 0)
+	{
+	  int blksize = atoi (val);
+
+	  if (blksize >= 8)
+	    {
+	      tftp.blksize = (blksize < TFTP_MAX_BLKSIZE
+			      ? blksize : TFTP_MAX_BLKSIZE);
+	      want_blksize = 1;
+	    }
+	}
+      else if (strcasecmp (opt, "tsize") == 0)
+	want_tsize = 1;
+    }
+
+  /* Don't go up from the root directory.  */
+  while (*name == '/')
+    name++;
+  if (strstr (name, "..")
+      || ! (path = malloc (strlen (server_root) + strlen (name) + 2)))
+    {
+      tftp_send_error (req, tftp_next_port, port, 2, "Access violation");
+      return;
+    }
+
+  sprintf (path, "%s/%s", server_root, name);
+  tftp.fd = open (path, O_RDONLY);
+  free (path);
+  if (tftp.fd < 0 || fstat (tftp.fd, &st) || ! S_ISREG (st.st_mode))
+    {
+      tftp_finish ();
+      tftp_send_error (req, tftp_next_port, port, 1, "File not found");
+      return;
+    }
+
+  if (verbose)
+    printf ("tftp: %s (%lu bytes)\n", name, (unsigned long) st.st_size);
+
+  tftp.size = st.st_size;
+  tftp.client_port = port;
+  tftp.server_port = tftp_next_port++;
+  if (tftp_next_port < 32768)
+    tftp_next_port = 32768;
+  tftp.offset = 0;
+  tftp.len = 0;
+
+  if (want_blksize || want_tsize)
+    {
+      int olen = 0;
+
+      /* Acknowledge the options, then wait for the ACK of block 0.  */
+      put16 (frame + UDP_DATA, 6);
+      if (want_blksize)
+	olen += sprintf ((char *) oack + olen, "blksize%c%u%c",
+			 0, tftp.blksize, 0);
+      if (want_tsize)
+	olen += sprintf ((char *) oack + olen, "tsize%c%lu%c",
+			 0, tftp.size, 0);
+
+      tftp.block = 0;
+      tftp.oack = 1;
+      server_send_udp (frame, req + 6, req + ETH_HDR + 12,
+		       tftp.server_port, tftp.client_port, 2 + olen);
+    }
+  else
+    {
+      tftp.block = 1;
+      tftp.oack = 0;
+      tftp_send_data (req);
+    }
+}
+
+/* Handle an ACK or an ERROR for the current transfer.  */
+static void
+tftp_ack (const unsigned char *req, int len)
+{
+  const unsigned char *tp = req + UDP_DATA;
+  unsigned short block;
+
+  if (tftp.fd < 0 || len < UDP_DATA + 4
+      || get16 (req + ETH_HDR + IP_HDR) != tftp.client_port)
+    return;
+
+  if (get16 (tp) == 5)
+    {
+      /* The client aborted the transfer.  */
+      tftp_finish ();
+      return;
+    }
+
+  if (get16 (tp) != 4)
+    return;
+
+  block = get16 (tp + 2);
+  if (block == tftp.block)
+    {
+      if (tftp.oack)
+	/* The options were acknowledged. Start with block 1.  */
+	tftp.oack = 0;
+      else if (tftp.len < tftp.blksize)
+	{
+	  /* The last block was shorter than the block size.  */
+	  tftp_finish ();
+	  return;
+	}
+      else
+	tftp.offset += tftp.len;
+
+      /* The block number wraps around after 65535 blocks.  */
+      tftp.block++;
+      tftp_send_data (req);
+    }
+  else if ((unsigned short) (block + 1) == tftp.block)
+    /* The client didn't see the current block. Resend it.  */
+    tftp_send_data (req);
+}
+
+/* Process a frame sent by the client.  */
+static void
+server_input (const unsigned char *frame, int len)
+{
+  const unsigned char *ip = frame + ETH_HDR;
+  unsigned int dport;
+
+  if (len < ETH_HDR)
+    return;
+
+  if (get16 (frame + 12) == 0x0806)
+    {
+      server_arp (frame, len);
+      return;
+    }
+
+  if (get16 (frame + 12) != 0x0800 || len < UDP_DATA
+      || ip[0] != 0x45 || ip[9] != 17)
+    return;
+
+  /* Trust the length in the IP header rather than the padded frame.  */
+  if (ETH_HDR + get16 (ip + 2) < len)
+    len = ETH_HDR + get16 (ip + 2);
+
+  dport = get16 (ip + IP_HDR + 2);
+  if (dport == BOOTP_SERVER_PORT)
+    server_bootp (frame, len);
+  else if (dport == TFTP_PORT && len >= UDP_DATA + 2
+	   && get16 (frame + UDP_DATA) == 1)
+    tftp_rrq (frame, len);
+  else if (tftp.fd >= 0 && dport == tftp.server_port)
+    tftp_ack (frame, len);
+}
+
+/* Let the built-in server process all the pending frames.  */
+static void
+server_run (void)
+{
+  unsigned char frame[FRAME_MAX];
+  ssize_t len;
+
+  while ((len = recv (server_fd, frame, sizeof (frame), MSG_DONTWAIT)) > 0)
+    server_input (frame, len);
+}
+
+/* Open the network device specified by NET_DEVICE, and store the MAC
+   address in NODE_ADDR. Return non-zero if successful.  */
+int
+hostnic_hw_open (unsigned char *node_addr)
+{
+  if (! net_device)
+    return 0;
+
+  if (net_fd >= 0)
+    hostnic_hw_close ();
+
+  if (strncmp (net_device, "dir:", 4) == 0)
+    {
+      int fds[2];
+
+      if (socketpair (AF_UNIX, SOCK_DGRAM, 0, fds))
+	{
+	  perror ("socketpair");
+	  return 0;
+	}
+
+      net_fd = fds[0];
+      server_fd = fds[1];
+      fcntl (net_fd, F_SETFL, O_NONBLOCK);
+      server_root = net_device + 4;
+    }
+#ifdef __linux__
+  else if (strncmp (net_device, "tap:", 4) == 0)
+    {
+      struct ifreq ifr;
+
+      net_fd = open ("/dev/net/tun", O_RDWR | O_NONBLOCK);
+      if (net_fd < 0)
+	{
+	  perror ("/dev/net/tun");
+	  return 0;
+	}
+
+      memset (&ifr, 0, sizeof (ifr));
+      ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+      strncpy (ifr.ifr_name, net_device + 4, IFNAMSIZ - 1);
+      if (ioctl (net_fd, TUNSETIFF, &ifr))
+	{
+	  perror ("TUNSETIFF");
+	  close (net_fd);
+	  net_fd = -1;
+	  return 0;
+	}
+    }
+#endif /* __linux__ */
+  else
+    {
+      fprintf (stderr, "Unknown network device: %s\n", net_device);
+      return 0;
+    }
+
+  memcpy (node_addr, client_mac, 6);
+  net_tx_frames = net_tx_bytes = net_rx_frames = net_rx_bytes = 0;
+  return 1;
+}
+
+/* Receive a frame into BUF whose size is SIZE. Return the length, or
+   zero if no frame is ready.  */
+int
+hostnic_hw_recv (char *buf, unsigned int size)
+{
+  ssize_t len;
+
+  if (net_fd < 0)
+    return 0;
+
+  len = read (net_fd, buf, size);
+  if (len <= 0)
+    return 0;
+
+  net_rx_frames++;
+  net_rx_bytes += len;
+  return len;
+}
+
+/* Send the frame BUF whose length is SIZE.  */
+int
+hostnic_hw_send (const char *buf, unsigned int size)
+{
+  if (net_fd < 0)
+    return 0;
+
+  if (write (net_fd, buf, size) != size)
+    return 0;
+
+  net_tx_frames++;
+  net_tx_bytes += size;
+
+  /* The built-in server answers immediately, so that the reply is
+     ready by the next poll.  */
+  if (server_fd >= 0)
+    server_run ();
+
+  return 1;
+}
+
+/* Close the network device.  */
+void
+hostnic_hw_close (void)
+{
+  if (net_fd < 0)
+    return;
+
+  if (verbose)
+    printf ("network: %lu frames (%lu bytes) sent, "
+	    "%lu frames (%lu bytes) received\n",
+	    net_tx_frames, net_tx_bytes, net_rx_frames, net_rx_bytes);
+
+  tftp_finish ();
+  close (net_fd);
+  net_fd = -1;
+  if (server_fd >= 0)
+    close (server_fd);
+  server_fd = -1;
+}
+
+#endif /* SUPPORT_NETBOOT */
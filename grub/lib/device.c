@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
@@ -131,6 +132,38 @@ get_kfreebsd_version ()
 #include <shared.h>
 #include <device.h>
 
+/* Make up the geometry of a disk image of TOTAL_SECTORS sectors for
+   DRIVE in GEOM.  */
+void
+get_image_geometry (struct geometry *geom, int drive,
+		    unsigned long total_sectors)
+{
+  geom->sector_size = SECTOR_SIZE;
+  geom->total_sectors = total_sectors;
+
+  if (! (drive & 0x80))
+    {
+      geom->heads = DEFAULT_FD_HEADS;
+      geom->sectors = DEFAULT_FD_SECTORS;
+    }
+  else
+    {
+      geom->sectors = DEFAULT_HD_SECTORS;
+      if (geom->total_sectors <= 63 * 1 * 1024)
+	geom->heads = 1;
+      else if (geom->total_sectors <= 63 * 16 * 1024)
+	geom->heads = 16;
+      else
+	geom->heads = 255;
+    }
+
+  geom->cylinders = (geom->total_sectors
+		     / geom->heads
+		     / geom->sectors);
+  if (geom->cylinders == 0)
+    geom->cylinders = 1;
+}
+
 /* Get the geometry of a drive DRIVE.  */
 void
 get_drive_geometry (struct geometry *geom, char **map, int drive)
@@ -147,6 +180,18 @@ get_drive_geometry (struct geometry *geom, char **map, int drive)
 
   /* XXX This is the default size.  */
   geom->sector_size = SECTOR_SIZE;
+
+  /* A regular file is a disk image, so make up the geometry from the
+     size of the file.  */
+  {
+    struct stat st;
+
+    if (! fstat (fd, &st) && S_ISREG (st.st_mode))
+      {
+	get_image_geometry (geom, drive, st.st_size >> SECTOR_BITS);
+	goto success;
+      }
+  }
   
 #if defined(__linux__)
   /* Linux */
@@ -489,6 +534,146 @@ check_device (const char *device)
   return 1;
 }
 
+/* The maximum number of devices checked at the same time.  */
+#define MAX_PARALLEL_CHECKS	16
+
+/* Check NUM devices in NAMES in parallel, and set OK[I] to the result of
+   check_device for NAMES[I]. Each device is checked in a child process,
+   so that a device which hangs for a while, like a floppy drive without
+   a floppy, doesn't delay the rest.  */
+static void
+check_devices (int num, char *names[], int *ok)
+{
+  pid_t pids[MAX_PARALLEL_CHECKS];
+  int start, i;
+
+  for (start = 0; start < num; start += MAX_PARALLEL_CHECKS)
+    {
+      int end = start + MAX_PARALLEL_CHECKS;
+
+      if (end > num)
+	end = num;
+
+      for (i = start; i < end; i++)
+	{
+	  pids[i - start] = -1;
+
+	  /* Don't bother to fork for a bogus name.  */
+	  if (! *names[i])
+	    {
+	      ok[i] = check_device (names[i]);
+	      continue;
+	    }
+
+	  pids[i - start] = fork ();
+	  if (pids[i - start] == 0)
+	    /* Don't flush the buffers of the parent in the child.  */
+	    _exit (check_device (names[i]) ? 0 : 1);
+
+	  if (pids[i - start] < 0)
+	    /* Check it by ourselves.  */
+	    ok[i] = check_device (names[i]);
+	}
+
+      for (i = start; i < end; i++)
+	if (pids[i - start] > 0)
+	  {
+	    int status;
+
+	    ok[i] = (waitpid (pids[i - start], &status, 0) == pids[i - start]
+		     && WIFEXITED (status) && WEXITSTATUS (status) == 0);
+	  }
+    }
+}
+
+#ifdef __linux__
+/* Check if we have sysfs support.  */
+static int
+have_sysfs (void)
+{
+  static int sys_block_exists = -1;
+
+  if (sys_block_exists < 0)
+    {
+      struct stat st;
+
+      sys_block_exists = (stat ("/sys/block", &st) == 0
+			  && S_ISDIR (st.st_mode));
+    }
+
+  return sys_block_exists;
+}
+
+/* Read the attribute ATTR of the block device DEVICE in sysfs into BUF,
+   which is LEN bytes long. If an error occurs, return zero, otherwise
+   return non-zero.  */
+static int
+read_sysfs_attr (const char *device, const char *attr, char *buf, int len)
+{
+  char path[PATH_MAX];
+  char *p;
+  FILE *fp;
+
+  /* The name of /dev/rd/c0d0 is rd!c0d0 in sysfs.  */
+  if (strncmp (device, "/dev/", 5) != 0
+      || strlen (device) + strlen (attr) + 16 > sizeof (path))
+    return 0;
+
+  sprintf (path, "/sys/block/%s", device + 5);
+  for (p = path + 11; *p; p++)
+    if (*p == '/')
+      *p = '!';
+
+  strcat (path, "/");
+  strcat (path, attr);
+
+  fp = fopen (path, "r");
+  if (! fp)
+    return 0;
+
+  if (! fgets (buf, len, fp))
+    *buf = 0;
+
+  fclose (fp);
+  return 1;
+}
+
+/* Check if DEVICE may be a BIOS drive, using the information in sysfs
+   without opening it. Return zero if it is absent, if it has no medium
+   or if it is a CD-ROM, otherwise return non-zero.  */
+static int
+sysfs_check_device (const char *device)
+{
+  char buf[32];
+
+  /* If sysfs is not available, it must be checked.  */
+  if (! have_sysfs () || ! *device)
+    return 1;
+
+  /* Absent.  */
+  if (! read_sysfs_attr (device, "size", buf, sizeof (buf)))
+    return 0;
+
+  /* A removable device without medium.  */
+  if (strtoul (buf, 0, 0) == 0)
+    return 0;
+
+  /* A SCSI CD-ROM (TYPE_ROM).  */
+  if (read_sysfs_attr (device, "device/type", buf, sizeof (buf))
+      && strtoul (buf, 0, 0) == 5)
+    return 0;
+
+  /* An IDE CD-ROM.  */
+  if (read_sysfs_attr (device, "device/media", buf, sizeof (buf))
+      && strncmp (buf, "cdrom", 5) == 0)
+    return 0;
+
+  /* A removable disk may be still unreadable, but check_device will
+     find it out.  */
+  return 1;
+}
+#endif /* __linux__ */
+
 /* Read mapping information from FP, and write it to MAP.  */
 static int
 read_device_map (FILE *fp, char **map, const char *map_file)
@@ -606,6 +791,10 @@ read_device_map (FILE *fp, char **map, const char *map_file)
   return 1;
 }
 
+/* The maximum number of devices probed: floppies, IDE disks, ATARAID
+   disks, SCSI disks and DAC960 disks.  */
+#define MAX_CANDIDATES	(8 + 8 + 8 + 16 + 8 * 15)
+
 /* Initialize the device map MAP. *MAP will be allocated from the heap
    space. If MAP_FILE is not NULL, then read mappings from the file
    MAP_FILE if it exists, otherwise, write guessed mappings to the file.
@@ -618,6 +807,61 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
   int i;
   int num_hd = 0;
   FILE *fp = 0;
+  /* The devices to be checked, floppies first.  */
+  char *candidates[MAX_CANDIDATES];
+  int ok[MAX_CANDIDATES];
+  int num_candidates = 0;
+  int num_fd;
+
+  /* Add the device NAME to the candidates.  */
+  auto void add_candidate (const char *name);
+  void add_candidate (const char *name)
+    {
+      assert (num_candidates < MAX_CANDIDATES);
+      candidates[num_candidates] = strdup (name);
+      assert (candidates[num_candidates]);
+      ok[num_candidates] = 1;
+      num_candidates++;
+    }
+
+  /* Check all the candidates, and put the floppies in the map.  */
+  auto void check_candidates (void);
+  void check_candidates (void)
+    {
+      char *names[MAX_CANDIDATES];
+      int results[MAX_CANDIDATES];
+      int indices[MAX_CANDIDATES];
+      int num = 0;
+      int j;
+      
+      /* Don't touch the devices which sysfs says are absent.  */
+      for (j = 0; j < num_candidates; j++)
+	{
+#ifdef __linux__
+	  if (! sysfs_check_device (candidates[j]))
+	    {
+	      ok[j] = 0;
+	      continue;
+	    }
+#endif /* __linux__ */
+	  names[num] = candidates[j];
+	  indices[num] = j;
+	  num++;
+	}
+
+      check_devices (num, names, results);
+      for (j = 0; j < num; j++)
+	ok[indices[j]] = results[j];
+
+      for (j = 0; j < num_fd; j++)
+	{
+	  if (ok[j])
+	    (*map)[j] = candidates[j];
+	  else
+	    free (candidates[j]);
+	  candidates[j] = 0;
+	}
+    }
 
   assert (map);
   assert (*map == 0);
@@ -665,16 +909,15 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
       if (fp)
 	fprintf (fp, "(fd%d)\t%s\n", i, name);
       
-      if (check_device (name))
-	{
-	  (*map)[i] = strdup (name);
-	  assert ((*map)[i]);
-	}
+      add_candidate (name);
     }
+  num_fd = num_candidates;
   
 #ifdef __linux__
   if (have_devfs ())
     {
+      check_candidates ();
+      
       while (1)
 	{
 	  char discn[32];
@@ -715,17 +958,7 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
       char name[16];
       
       get_ide_disk_name (name, i);
-      if (check_device (name))
-	{
-	  (*map)[num_hd + 0x80] = strdup (name);
-	  assert ((*map)[num_hd + 0x80]);
-	  
-	  /* If the device map file is opened, write the map.  */
-	  if (fp)
-	    fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-	  
-	  num_hd++;
-	}
+      add_candidate (name);
     }
   
 #ifdef __linux__
@@ -735,17 +968,7 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
       char name[20];
 
       get_ataraid_disk_name (name, i);
-      if (check_device (name))
-        {
-          (*map)[num_hd + 0x80] = strdup (name);
-          assert ((*map)[num_hd + 0x80]);
-
-          /* If the device map file is opened, write the map.  */
-          if (fp)
-            fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-
-          num_hd++;
-        }
+      add_candidate (name);
     }
 #endif /* __linux__ */
 
@@ -755,17 +978,7 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
       char name[16];
       
       get_scsi_disk_name (name, i);
-      if (check_device (name))
-	{
-	  (*map)[num_hd + 0x80] = strdup (name);
-	  assert ((*map)[num_hd + 0x80]);
-	  
-	  /* If the device map file is opened, write the map.  */
-	  if (fp)
-	    fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-	  
-	  num_hd++;
-	}
+      add_candidate (name);
     }
   
 #ifdef __linux__
@@ -784,21 +997,31 @@ init_device_map (char ***map, const char *map_file, int floppy_disks)
 	    char name[24];
 	    
 	    get_dac960_disk_name (name, controller, drive);
-	    if (check_device (name))
-	      {
-		(*map)[num_hd + 0x80] = strdup (name);
-		assert ((*map)[num_hd + 0x80]);
-		
-		/* If the device map file is opened, write the map.  */
-		if (fp)
-		  fprintf (fp, "(hd%d)\t%s\n", num_hd, name);
-		
-		num_hd++;
-	      }
+	    add_candidate (name);
 	  }
       }
   }
 #endif /* __linux__ */
+
+  check_candidates ();
+  
+  /* Number the disks that can be read in the order of the candidates.  */
+  for (i = num_fd; i < num_candidates; i++)
+    if (ok[i])
+      {
+	(*map)[num_hd + 0x80] = candidates[i];
+	candidates[i] = 0;
+	
+	/* If the device map file is opened, write the map.  */
+	if (fp)
+	  fprintf (fp, "(hd%d)\t%s\n", num_hd, (*map)[num_hd + 0x80]);
+	
+	num_hd++;
+      }
+  
+  for (i = num_fd; i < num_candidates; i++)
+    if (candidates[i])
+      free (candidates[i]);
   
   /* OK, close the device map file if opened.  */
   if (fp)
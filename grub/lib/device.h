@@ -33,12 +33,24 @@
 #define DEFAULT_HD_SECTORS	63
 
 /* Function prototypes.  */
+extern void get_image_geometry (struct geometry *geom, int drive,
+				unsigned long total_sectors);
 extern void get_drive_geometry (struct geometry *geom, char **map, int drive);
 extern int check_device (const char *device);
 extern int init_device_map (char ***map, const char *map_file,
 			    int no_floppies);
 extern void restore_device_map (char **map);
 
+/* The disk images in grub/diskimage.c.  */
+struct disk_image;
+extern int open_disk_image (int fd, int allow_raw, struct disk_image **image);
+extern void close_disk_image (struct disk_image *image);
+extern unsigned long disk_image_sectors (struct disk_image *image);
+extern int read_disk_image (struct disk_image *image, unsigned long sector,
+			    int nsec, char *buf);
+extern int write_disk_image (struct disk_image *image, unsigned long sector,
+			     int nsec, const char *buf);
+
 #ifdef __linux__
 extern int is_disk_device (char **map, int drive);
 extern int write_to_partition (char **map, int drive, int partition,
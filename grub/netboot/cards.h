@@ -180,4 +180,9 @@ extern struct nic	*tlan_probe(struct nic *, unsigned short *
         PCI_ARG(struct pci_device *));
 #endif
 
+#ifdef	INCLUDE_HOSTNIC
+extern struct nic	*hostnic_probe(struct nic *, unsigned short *
+	PCI_ARG(struct pci_device *));
+#endif
+
 #endif	/* CARDS_H */
@@ -362,6 +362,9 @@ struct dispatch_table
  */
 static struct dispatch_table	NIC[] =
 {
+#ifdef	INCLUDE_HOSTNIC
+  { "HOSTNIC", hostnic_probe, 0 },
+#endif
 #ifdef	INCLUDE_RTL8139
   { "RTL8139", rtl8139_probe, pci_ioaddrs },
 #endif
@@ -472,6 +475,18 @@ eth_dummy (struct nic *dummy)
 
 static char	packet[ETH_FRAME_LEN];
 
+/* The frames drained from the card, but not processed yet. Emptying
+   the receive ring of the card as soon as possible prevents a burst of
+   frames from overflowing it.  */
+#define ETH_RXQ_SIZE	8
+
+static struct
+{
+  unsigned int len;
+  char data[ETH_FRAME_LEN];
+} rxq[ETH_RXQ_SIZE];
+static int rxq_head, rxq_count;
+
 struct nic	nic =
 {
   (void (*) (struct nic *)) eth_dummy,	/* reset */
@@ -495,6 +510,7 @@ struct nic	nic =
 void
 eth_reset (void)
 {
+  rxq_head = rxq_count = 0;
   (*nic.reset) (&nic);
 }
 
@@ -580,7 +596,27 @@ eth_probe (void)
 int
 eth_poll (void)
 {
-  return ((*nic.poll) (&nic));
+  /* If nothing is queued, take all the frames ready in the card.  */
+  if (! rxq_count)
+    {
+      while (rxq_count < ETH_RXQ_SIZE && (*nic.poll) (&nic))
+	{
+	  int tail = (rxq_head + rxq_count) % ETH_RXQ_SIZE;
+
+	  rxq[tail].len = nic.packetlen;
+	  grub_memmove (rxq[tail].data, nic.packet, nic.packetlen);
+	  rxq_count++;
+	}
+
+      if (! rxq_count)
+	return 0;
+    }
+
+  nic.packetlen = rxq[rxq_head].len;
+  grub_memmove (nic.packet, rxq[rxq_head].data, nic.packetlen);
+  rxq_head = (rxq_head + 1) % ETH_RXQ_SIZE;
+  rxq_count--;
+  return 1;
 }
 
 void
@@ -594,5 +630,6 @@ eth_transmit (const char *d, unsigned int t, unsigned int s, const void *p)
 void
 eth_disable (void)
 {
+  rxq_head = rxq_count = 0;
   (*nic.disable) (&nic);
 }
@@ -234,13 +234,18 @@ struct RxFD {               /* Receive frame descriptor. */
   char packet[1518];
 };
 
+/* The receive frame descriptors form a ring, so that the chip can
+   keep receiving frames while the previous ones are processed. The
+   last free descriptor has the EL and S bits set.  */
+#define RX_RING_SIZE	8
+#define RX_FD_EL_S	0xc000
+
 #ifdef	USE_LOWMEM_BUFFER
-#define rxfd ((struct RxFD *)(0x10000 - sizeof(struct RxFD)))
-#define ACCESS(x) x->
+#define rxfds ((struct RxFD *)(0x10000 - RX_RING_SIZE * sizeof(struct RxFD)))
 #else
-static struct RxFD rxfd;
-#define ACCESS(x) x.
+static struct RxFD rxfds[RX_RING_SIZE];
 #endif
+static int cur_rx;
 
 static int congenb = 0;         /* Enable congestion control in the DP83840. */
 static int txfifo = 8;          /* Tx FIFO threshold in 4 byte units, 0-15 */
@@ -442,24 +447,38 @@ static void eepro100_transmit(struct nic *nic, const char *d, unsigned int t, un
 
 static int eepro100_poll(struct nic *nic)
 {
-  if (!ACCESS(rxfd)status)
-    return 0;
+  int prev;
 
-  /* Ok. We got a packet. Now restart the reciever.... */
-  ACCESS(rxfd)status = 0;
-  ACCESS(rxfd)command = 0xc000;
-  outl(virt_to_bus(&(ACCESS(rxfd)status)), ioaddr + SCBPointer);
-  outw(INT_MASK | RX_START, ioaddr + SCBCmd);
-  wait_for_cmd_done(ioaddr + SCBCmd);
+  if (!rxfds[cur_rx].status)
+    return 0;
 
 #ifdef	DEBUG
-  printf ("Got a packet: Len = %d.\n", ACCESS(rxfd)count & 0x3fff);
+  printf ("Got a packet: Len = %d.\n", rxfds[cur_rx].count & 0x3fff);
 #endif
-  nic->packetlen =  ACCESS(rxfd)count & 0x3fff;
-  memcpy (nic->packet, ACCESS(rxfd)packet, nic->packetlen);
+  nic->packetlen =  rxfds[cur_rx].count & 0x3fff;
+  memcpy (nic->packet, rxfds[cur_rx].packet, nic->packetlen);
 #ifdef	DEBUG
   hd (nic->packet, 0x30);
 #endif
+
+  /* Give the descriptor back to the chip as the new end of the list,
+     and only then clear the end mark of the previous one.  */
+  rxfds[cur_rx].status = 0;
+  rxfds[cur_rx].count = 0;
+  rxfds[cur_rx].command = RX_FD_EL_S;
+  prev = (cur_rx + RX_RING_SIZE - 1) % RX_RING_SIZE;
+  rxfds[prev].command = 0;
+
+  /* If the receiver has stopped because the ring was full, restart
+     it from the descriptor just freed.  */
+  if ((inw(ioaddr + SCBStatus) & 0x003c) != 0x0010)
+    {
+      outl(virt_to_bus(&rxfds[cur_rx].status), ioaddr + SCBPointer);
+      outw(INT_MASK | RX_START, ioaddr + SCBCmd);
+      wait_for_cmd_done(ioaddr + SCBCmd);
+    }
+
+  cur_rx = (cur_rx + 1) % RX_RING_SIZE;
   return 1;
 }
 
@@ -540,25 +559,25 @@ struct nic *eepro100_probe(struct nic *nic, unsigned short *probeaddrs, struct p
 
   whereami ("set rx base addr.");
 
-  ACCESS(rxfd)status  = 0x0001;
-  ACCESS(rxfd)command = 0x0000;
-  ACCESS(rxfd)link    = virt_to_bus(&(ACCESS(rxfd)status));
-  ACCESS(rxfd)rx_buf_addr = (int) &nic->packet;
-  ACCESS(rxfd)count   = 0;
-  ACCESS(rxfd)size    = 1528;
+  for (i = 0; i < RX_RING_SIZE; i++)
+    {
+      rxfds[i].status  = 0;
+      rxfds[i].command = 0;
+      rxfds[i].link    = virt_to_bus(&rxfds[(i + 1) % RX_RING_SIZE].status);
+      rxfds[i].rx_buf_addr = 0xffffffff;
+      rxfds[i].count   = 0;
+      rxfds[i].size    = 1528;
+    }
+  rxfds[RX_RING_SIZE - 1].command = RX_FD_EL_S;
+  cur_rx = 0;
 
-  outl(virt_to_bus(&(ACCESS(rxfd)status)), ioaddr + SCBPointer);
+  /* Start the reciever.... */
+  outl(virt_to_bus(&rxfds[0].status), ioaddr + SCBPointer);
   outw(INT_MASK | RX_START, ioaddr + SCBCmd);
   wait_for_cmd_done(ioaddr + SCBCmd);
 
   whereami ("started RX process.");
 
-  /* Start the reciever.... */
-  ACCESS(rxfd)status = 0;
-  ACCESS(rxfd)command = 0xc000;
-  outl(virt_to_bus(&(ACCESS(rxfd)status)), ioaddr + SCBPointer);
-  outw(INT_MASK | RX_START, ioaddr + SCBCmd);
-
   /* INIT TX stuff. */
 
   /* Base = 0 */
@@ -0,0 +1,101 @@
+/* hostnic.c - the network device emulated by the grub shell */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2005  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* This "driver" makes sense only in the grub shell. It doesn't touch
+   any hardware, but passes ethernet frames to the host through the
+   functions in grub/netstub.c, so that BOOTP, DHCP and TFTP can be
+   tested without a real network card.  */
+
+#define GRUB	1
+#include <etherboot.h>
+#include <nic.h>
+#include <cards.h>
+
+/* These are defined in grub/netstub.c, and never be used elsewhere, so
+   declare the prototypes here.  */
+extern int hostnic_hw_open (unsigned char *node_addr);
+extern int hostnic_hw_recv (char *buf, unsigned int size);
+extern int hostnic_hw_send (const char *buf, unsigned int size);
+extern void hostnic_hw_close (void);
+
+/* The buffer to construct a frame to be sent.  */
+static char txbuf[ETH_FRAME_LEN];
+
+static void
+hostnic_reset (struct nic *nic)
+{
+  /* Nothing to do.  */
+}
+
+static int
+hostnic_poll (struct nic *nic)
+{
+  int len;
+
+  len = hostnic_hw_recv (nic->packet, ETH_FRAME_LEN);
+  if (len < ETH_HLEN)
+    return 0;
+
+  nic->packetlen = len;
+  return 1;
+}
+
+static void
+hostnic_transmit (struct nic *nic, const char *d, unsigned int t,
+		  unsigned int s, const char *p)
+{
+  /* Silently truncate a jumbo frame, as the hardware would do.  */
+  if (s > ETH_FRAME_LEN - ETH_HLEN)
+    s = ETH_FRAME_LEN - ETH_HLEN;
+
+  grub_memmove (txbuf, d, ETH_ALEN);
+  grub_memmove (txbuf + ETH_ALEN, nic->node_addr, ETH_ALEN);
+  txbuf[12] = (t >> 8) & 0xff;
+  txbuf[13] = t & 0xff;
+  grub_memmove (txbuf + ETH_HLEN, p, s);
+  s += ETH_HLEN;
+
+  /* Pad a short frame.  */
+  while (s < ETH_ZLEN)
+    txbuf[s++] = 0;
+
+  hostnic_hw_send (txbuf, s);
+}
+
+static void
+hostnic_disable (struct nic *nic)
+{
+  hostnic_hw_close ();
+}
+
+struct nic *
+hostnic_probe (struct nic *nic, unsigned short *probe_addrs)
+{
+  if (! hostnic_hw_open (nic->node_addr))
+    return 0;
+
+  etherboot_printf ("\nemulated network device, addr %!\n", nic->node_addr);
+
+  nic->reset = hostnic_reset;
+  nic->poll = hostnic_poll;
+  nic->transmit = hostnic_transmit;
+  nic->disable = hostnic_disable;
+  return nic;
+}
@@ -681,8 +681,77 @@ bootp (void)
 }
 
 /**************************************************************************
-UDPCHKSUM - Checksum UDP Packet (one of the rare cases when assembly is
-            actually simpler...)
+IPSUM_PARTIAL - Add 16-bit words to a ones' complement sum
+ Words are added as they are in memory, that is, in network byte order,
+ so no byte swapping is needed. The 32-bit accumulator cannot overflow
+ for any frame, so the carries are folded only once by IPSUM_FOLD.
+**************************************************************************/
+static unsigned long
+ipsum_partial (const void *buf, int len, unsigned long sum)
+{
+  const unsigned char *p = buf;
+  const unsigned short *w;
+  unsigned long s = 0;
+  unsigned short t;
+  int odd = 0;
+
+  if (len <= 0)
+    return sum;
+
+  /* If BUF is at an odd address, start with the first byte as the
+     second half of a word. This only swaps the bytes of the result.  */
+  if ((unsigned long) p & 1)
+    {
+      odd = 1;
+      t = 0;
+      ((unsigned char *) &t)[1] = *p++;
+      s = t;
+      len--;
+    }
+
+  w = (const unsigned short *) p;
+  while (len >= 16)
+    {
+      s += w[0] + w[1] + w[2] + w[3];
+      s += w[4] + w[5] + w[6] + w[7];
+      w += 8;
+      len -= 16;
+    }
+
+  while (len >= 2)
+    {
+      s += *w++;
+      len -= 2;
+    }
+
+  /* Pad the last byte with zero.  */
+  if (len)
+    {
+      t = 0;
+      *(unsigned char *) &t = *(const unsigned char *) w;
+      s += t;
+    }
+
+  if (odd)
+    {
+      s = (s & 0xffff) + (s >> 16);
+      s = (s & 0xffff) + (s >> 16);
+      s = ((s & 0xff) << 8) | (s >> 8);
+    }
+
+  return sum + s;
+}
+
+static unsigned short
+ipsum_fold (unsigned long sum)
+{
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+/**************************************************************************
+UDPCHKSUM - Checksum UDP Packet
  RETURNS: checksum, 0 on checksum error. This
           allows for using the same routine for RX and TX summing:
           RX  if (packet->udp.chksum && udpchksum(packet))
@@ -691,21 +760,6 @@ UDPCHKSUM - Checksum UDP Packet (one of the rare cases when assembly is
               if (0==(packet->udp.chksum=udpchksum(packet)))
                   packet->upd.chksum=0xffff;
 **************************************************************************/
-static inline void
-dosum (unsigned short *start, unsigned int len, unsigned short *sum)
-{
-  __asm__ __volatile__
-    ("clc\n"
-     "1:\tlodsw\n\t"
-     "xchg %%al,%%ah\n\t"	/* convert to host byte order */
-     "adcw %%ax,%0\n\t"		/* add carry of previous iteration */
-     "loop 1b\n\t"
-     "adcw $0,%0"		/* add carry of last iteration */
-     : "=b" (*sum), "=S"(start), "=c"(len)
-     : "0"(*sum), "1"(start), "2"(len)
-     : "ax", "cc"
-     );
-}
 
 /* UDP sum:
  * proto, src_ip, dst_ip, udp_dport, udp_sport, 2*udp_len, payload
@@ -714,22 +768,17 @@ static unsigned short
 udpchksum (struct iphdr *packet)
 {
   int len = ntohs (packet->len);
-  unsigned short rval;
+  unsigned long sum;
   
   /* add udplength + protocol number */
-  rval = (len - sizeof (struct iphdr)) + IP_UDP;
-  
-  /* pad to an even number of bytes */
-  if (len % 2) {
-    ((char *) packet)[len++] = 0;
-  }
+  sum = htons (len - sizeof (struct iphdr) + IP_UDP);
   
   /* sum over src/dst ipaddr + udp packet */
   len -= (char *) &packet->src - (char *) packet;
-  dosum ((unsigned short *) &packet->src, len >> 1, &rval);
+  sum = ipsum_partial (&packet->src, len, sum);
   
   /* take one's complement */
-  return ~rval;
+  return ntohs (~ipsum_fold (sum) & 0xFFFF);
 }
 
 /**************************************************************************
@@ -869,6 +918,13 @@ await_reply (int type, int ival, void *ptr, int timeout)
 	  
 	  udp = (struct udphdr *) &nic.packet[(ETH_HLEN
 					       + sizeof (struct iphdr))];
+#ifdef NO_TFTP_UDP_CHKSUM
+	  /* The card has already checked the CRC of the frame, so don't
+	     spend time on the checksum of every TFTP data packet.  */
+	  if (type == AWAIT_TFTP && ntohs (udp->dest) == ival)
+	    return 1;
+#endif /* NO_TFTP_UDP_CHKSUM */
+	  
 	  if (udp->chksum && udpchksum (ip))
 	    {
 	      grub_printf ("UDP checksum error\n");
@@ -1116,15 +1172,7 @@ IPCHKSUM - Checksum IP Header
 static unsigned short 
 ipchksum (unsigned short *ip, int len)
 {
-  unsigned long sum = 0;
-  len >>= 1;
-  while (len--)
-    {
-      sum += *(ip++);
-      if (sum > 0xFFFF)
-	sum -= 0xFFFF;
-    }
-  return (~sum) & 0x0000FFFF;
+  return (~ipsum_fold (ipsum_partial (ip, len, 0))) & 0x0000FFFF;
 }
 
 #define TWO_SECOND_DIVISOR (2147483647l/TICKS_PER_SEC)
@@ -76,7 +76,7 @@
 #define TX_DMA_BURST    4       /* Calculate as 16<<val. */
 #define NUM_TX_DESC     4       /* Number of Tx descriptor registers. */
 #define TX_BUF_SIZE	ETH_FRAME_LEN	/* FCS is added by the chip */
-#define RX_BUF_LEN_IDX 0	/* 0, 1, 2 is allowed - 8,16,32K rx buffer */
+#define RX_BUF_LEN_IDX 2	/* 0, 1, 2 is allowed - 8,16,32K rx buffer */
 #define RX_BUF_LEN (8192 << RX_BUF_LEN_IDX)
 
 #undef DEBUG_TX
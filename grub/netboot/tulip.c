@@ -391,7 +391,7 @@ static struct tulip_tx_desc tx_ring[TX_RING_SIZE] __attribute__ ((aligned(4)));
 static unsigned char txb[BUFLEN] __attribute__ ((aligned(4)));
 #endif
 
-#define RX_RING_SIZE	4
+#define RX_RING_SIZE	16
 static struct tulip_rx_desc rx_ring[RX_RING_SIZE] __attribute__ ((aligned(4)));
 
 #ifdef USE_LOWMEM_BUFFER
@@ -30,6 +30,119 @@ entry_func entry_addr;
 static struct mod_list mll[99];
 static int linux_mem_size;
 
+/* Read SIZE bytes at OFFSET in the file being loaded into DEST. The
+   first HEAD_LEN bytes of the file are copied from HEAD, which holds
+   them already. Seeking backward forces a compressed file to be
+   inflated again from the start, and a file over TFTP to be fetched
+   again, so the callers read the file in the order of the offsets.  */
+static int
+read_file_range (char *dest, int offset, int size, char *head, int head_len)
+{
+  if (offset < head_len)
+    {
+      int n = head_len - offset;
+
+      if (n > size)
+	n = size;
+      grub_memmove (dest, head + offset, n);
+      dest += n;
+      offset += n;
+      size -= n;
+    }
+
+  if (size <= 0)
+    return ! errnum;
+
+  if (offset != filepos && grub_seek (offset) < 0)
+    return 0;
+
+  return grub_read (dest, size) == size;
+}
+
+/* Convert the headers of an ELF64 image in HEAD, which holds the first
+   LEN bytes of the file, to ELF32 in place, so that the image is loaded
+   by the ELF32 loader. The segments are loaded at their physical
+   addresses, and the entry address is translated to the physical one,
+   so a kernel which switches to the long mode by itself can be booted.
+   Since GRUB runs in the 32-bit protected mode, everything must lie
+   below 4GB. The program header table keeps the stride of the ELF64
+   one, and the section header table is dropped, as the Multiboot
+   information can't describe the ELF64 sections.  */
+static int
+elf64_to_elf32 (unsigned char *head, int len)
+{
+  Elf64_Ehdr eh64 = *((Elf64_Ehdr *) head);
+  Elf32_Ehdr *eh32 = (Elf32_Ehdr *) head;
+  unsigned long long entry = eh64.e_entry;
+  int i, entry_found = 0;
+
+  if (eh64.e_phoff < sizeof (Elf64_Ehdr) || eh64.e_phnum == 0
+      || eh64.e_phentsize < sizeof (Elf64_Phdr)
+      || (eh64.e_phoff + (eh64.e_phentsize * eh64.e_phnum)) >= len)
+    {
+      errnum = ERR_EXEC_FORMAT;
+      return 0;
+    }
+
+  for (i = 0; i < eh64.e_phnum; i++)
+    {
+      unsigned char *ph = head + eh64.e_phoff + eh64.e_phentsize * i;
+      Elf64_Phdr ph64 = *((Elf64_Phdr *) ph);
+      Elf32_Phdr *ph32 = (Elf32_Phdr *) ph;
+
+      ph32->p_type = ph64.p_type;
+      if (ph64.p_type != PT_LOAD)
+	continue;
+
+      if (ph64.p_paddr > 0xFFFFFFFFULL
+	  || ph64.p_memsz > 0x100000000ULL - ph64.p_paddr
+	  || ph64.p_offset > 0xFFFFFFFFULL
+	  || ph64.p_filesz > 0xFFFFFFFFULL)
+	{
+	  errnum = ERR_WONT_FIT;
+	  return 0;
+	}
+
+      if (! entry_found
+	  && eh64.e_entry >= ph64.p_vaddr
+	  && eh64.e_entry - ph64.p_vaddr < ph64.p_memsz)
+	{
+	  entry = eh64.e_entry - ph64.p_vaddr + ph64.p_paddr;
+	  entry_found = 1;
+	}
+
+      ph32->p_offset = ph64.p_offset;
+      ph32->p_vaddr = ph64.p_paddr;
+      ph32->p_paddr = ph64.p_paddr;
+      ph32->p_filesz = ph64.p_filesz;
+      ph32->p_memsz = ph64.p_memsz;
+      ph32->p_flags = ph64.p_flags;
+      ph32->p_align = ph64.p_align;
+    }
+
+  if (entry > 0xFFFFFFFFULL)
+    {
+      errnum = ERR_EXEC_FORMAT;
+      return 0;
+    }
+
+  eh32->e_ident[EI_CLASS] = ELFCLASS32;
+  eh32->e_type = eh64.e_type;
+  eh32->e_machine = EM_386;
+  eh32->e_version = eh64.e_version;
+  eh32->e_entry = entry;
+  eh32->e_phoff = eh64.e_phoff;
+  eh32->e_shoff = 0;
+  eh32->e_flags = eh64.e_flags;
+  eh32->e_ehsize = sizeof (Elf32_Ehdr);
+  eh32->e_phentsize = eh64.e_phentsize;
+  eh32->e_phnum = eh64.e_phnum;
+  eh32->e_shentsize = 0;
+  eh32->e_shnum = 0;
+  eh32->e_shstrndx = 0;
+  return 1;
+}
+
 /*
  *  The next two functions, 'load_image' and 'load_module', are the building
  *  blocks of the multiboot loader component.  They handle essentially all
@@ -61,6 +174,13 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
      buffer by default */
   pu.aout = (struct exec *) buffer;
 
+  /* The image and its modules may be loaded anywhere in the extended
+     memory, so the caches must stay out of it from now on.  */
+  extmem_close ();
+
+  /* The memory used by the previous kernel and modules is free.  */
+  mem_place_reset ();
+
   if (!grub_open (kernel))
     return KERNEL_TYPE_NONE;
 
@@ -95,6 +215,21 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
      or bzImage.  */
   lh = (struct linux_kernel_header *) buffer;
   
+  /* A multiboot kernel in ELF64 is loaded as an ELF32 one, unless the
+     multiboot header gives the addresses.  */
+  if (type == KERNEL_TYPE_MULTIBOOT && ! (flags & MULTIBOOT_AOUT_KLUDGE)
+      && len > sizeof (Elf64_Ehdr)
+      && BOOTABLE_X86_64_ELF ((*((Elf64_Ehdr *) buffer))))
+    {
+      if (! elf64_to_elf32 (buffer, len))
+	{
+	  grub_close ();
+	  return KERNEL_TYPE_NONE;
+	}
+
+      str = "elf64";
+    }
+
   /* ELF loading supported if multiboot, FreeBSD and NetBSD.  */
   if ((type == KERNEL_TYPE_MULTIBOOT
        || pu.elf->e_ident[EI_OSABI] == ELFOSABI_FREEBSD
@@ -117,7 +252,8 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	  || ((pu.elf->e_phoff + (pu.elf->e_phentsize * pu.elf->e_phnum))
 	      >= len))
 	errnum = ERR_EXEC_FORMAT;
-      str = "elf";
+      if (! str)
+	str = "elf";
 
       if (type == KERNEL_TYPE_NONE)
 	{
@@ -221,6 +357,7 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
     {
       int big_linux = 0;
       int setup_sects = lh->setup_sects;
+      unsigned long load_addr = 0x100000, load_size;
 
       if (lh->header == LINUX_MAGIC_SIGNATURE && lh->version >= 0x0200)
 	{
@@ -266,8 +403,48 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 
       data_len = setup_sects << 9;
       text_len = filemax - data_len - SECTOR_SIZE;
+      load_size = text_len;
+
+      /* A relocatable kernel is loaded at an address aligned as it
+	 requires, so that the decompressor doesn't have to move it,
+	 preferably at the address given by the kernel.  */
+      if (big_linux && lh->version >= 0x0205 && lh->relocatable_kernel
+	  && lh->kernel_alignment >= 0x1000
+	  && ! (lh->kernel_alignment & (lh->kernel_alignment - 1)))
+	{
+	  unsigned long addr = 0;
+
+	  if (lh->version >= 0x020a && lh->init_size > load_size)
+	    load_size = lh->init_size;
 
-      linux_data_tmp_addr = (char *) LINUX_BZIMAGE_ADDR + text_len;
+	  if (lh->version >= 0x020a
+	      && lh->pref_address >= 0x100000
+	      && lh->pref_address < 0xFFFFFFFF - load_size)
+	    addr = mem_place (load_size, 0x1000, lh->pref_address,
+			      lh->pref_address + load_size, 0);
+
+	  if (! addr)
+	    addr = mem_place (load_size, lh->kernel_alignment, 0x100000,
+			      0xFFFFFFFF, 0);
+
+	  if (addr)
+	    {
+	      load_addr = addr;
+	      lh->code32_start = load_addr;
+	    }
+	}
+
+      /* Read the real mode part in place, if it doesn't overlap the
+	 buffers of GRUB, and otherwise after the kernel, from which
+	 it is copied at the boot.  */
+      if (linux_data_real_addr >= (char *) LINUX_DIRECT_REAL_MODE_ADDR)
+	linux_data_tmp_addr = linux_data_real_addr;
+      else
+	{
+	  linux_data_tmp_addr = (char *) RAW_ADDR (load_addr) + text_len;
+	  if (load_size < text_len + LINUX_SETUP_MOVE_SIZE)
+	    load_size = text_len + LINUX_SETUP_MOVE_SIZE;
+	}
       
       if (! big_linux
 	  && text_len > linux_data_real_addr - (char *) LINUX_ZIMAGE_ADDR)
@@ -280,8 +457,11 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	errnum = ERR_WONT_FIT;
       else
 	{
-	  grub_printf ("   [Linux-%s, setup=0x%x, size=0x%x]\n",
+	  grub_printf ("   [Linux-%s, setup=0x%x, size=0x%x",
 		       (big_linux ? "bzImage" : "zImage"), data_len, text_len);
+	  if (load_addr != 0x100000)
+	    grub_printf (", loadaddr=0x%x", load_addr);
+	  grub_printf ("]\n");
 
 	  /* Video mode selection support. What a mess!  */
 	  /* NOTE: Even the word "mess" is not still enough to
@@ -444,7 +624,12 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	  grub_seek (data_len + SECTOR_SIZE);
       
 	  cur_addr = (int) linux_data_tmp_addr + LINUX_SETUP_MOVE_SIZE;
-	  grub_read ((char *) LINUX_BZIMAGE_ADDR, text_len);
+	  grub_read ((char *) RAW_ADDR (load_addr), text_len);
+	  mem_place_reserve (load_addr, load_size);
+
+	  /* Check the digest of the kernel, if required.  */
+	  if (errnum == ERR_NONE)
+	    verify_file ();
       
 	  if (errnum == ERR_NONE)
 	    {
@@ -493,6 +678,8 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 
   if (exec_type)		/* can be loaded like a.out */
     {
+      int load_addr = cur_addr;
+
       if (flags & MULTIBOOT_AOUT_KLUDGE)
 	str = "-and-data";
 
@@ -585,66 +772,174 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	  else
 	    mbi.flags |= MB_INFO_AOUT_SYMS;
 	}
+
+      if (! errnum)
+	mem_place_reserve (load_addr, cur_addr - load_addr);
     }
   else
     /* ELF executable */
     {
-      unsigned loaded = 0, memaddr, memsiz, filesiz;
+      unsigned loaded = 0, memaddr, memsiz, filesiz, lowest = ~0;
       Elf32_Phdr *phdr;
+      Elf32_Shdr *shdr;
+      int tab_size, sec_size, next, sym_pending;
+      int symtab_err = 0;
+      unsigned sym_start, sym_end, sym_addr = 0;
+      unsigned prev_offset = 0, next_offset = 0;
 
       /* reset this to zero for now */
       cur_addr = 0;
 
-      /* scan for program segments */
+      /* The segments, the section header table and the sections
+	 are read in the order of their offsets, so that the file is
+	 read forward only. The part of the file from the end of the
+	 last segment in front of the section header table to the end
+	 of the table usually holds the symbol table and the string
+	 tables, so that part is read in one piece when it is reached,
+	 and the sections in it are used in place.  */
+      tab_size = pu.elf->e_shentsize * pu.elf->e_shnum;
+      sym_start = sym_end = pu.elf->e_shoff + tab_size;
+      if (tab_size)
+	sym_start = len < pu.elf->e_shoff ? len : pu.elf->e_shoff;
+      
+      /* Find the end of the segments in memory, and the start of the
+	 part of the file after them.  */
       for (i = 0; i < pu.elf->e_phnum; i++)
 	{
 	  phdr = (Elf32_Phdr *)
 	    (pu.elf->e_phoff + ((int) buffer)
 	     + (pu.elf->e_phentsize * i));
-	  if (phdr->p_type == PT_LOAD)
+	  if (phdr->p_type != PT_LOAD)
+	    continue;
+
+	  if (type == KERNEL_TYPE_FREEBSD || type == KERNEL_TYPE_NETBSD)
+	    memaddr = RAW_ADDR (phdr->p_paddr & 0xFFFFFF);
+	  else
+	    memaddr = RAW_ADDR (phdr->p_paddr);
+	  
+	  if (cur_addr < memaddr + phdr->p_memsz)
+	    cur_addr = memaddr + phdr->p_memsz;
+
+	  if (lowest > memaddr)
+	    lowest = memaddr;
+	  
+	  if (tab_size && phdr->p_offset < pu.elf->e_shoff
+	      && sym_start < phdr->p_offset + phdr->p_filesz)
+	    sym_start = phdr->p_offset + phdr->p_filesz;
+	}
+
+      if (sym_start > pu.elf->e_shoff)
+	sym_start = pu.elf->e_shoff;
+
+      if (lowest < cur_addr)
+	mem_place_reserve (lowest, cur_addr - lowest);
+
+      /* We should align to a 4K boundary here for good measure, but
+	 keep the offset in a page, so that the sections in the part
+	 read in one piece stay aligned.  */
+      if (align_4k)
+	cur_addr = (cur_addr + 0xFFF) & 0xFFFFF000;
+      
+      if (tab_size)
+	{
+	  sym_addr = cur_addr + (sym_start & 0xFFF);
+	  if (! memcheck (sym_addr, sym_end - sym_start))
 	    {
-	      /* offset into file */
-	      grub_seek (phdr->p_offset);
-	      filesiz = phdr->p_filesz;
-	      
-	      if (type == KERNEL_TYPE_FREEBSD || type == KERNEL_TYPE_NETBSD)
-		memaddr = RAW_ADDR (phdr->p_paddr & 0xFFFFFF);
-	      else
-		memaddr = RAW_ADDR (phdr->p_paddr);
+	      /* Read only the section header table.  */
+	      errnum = ERR_NONE;
+	      sym_start = pu.elf->e_shoff;
+	      sym_addr = cur_addr + (sym_start & 0xFFF);
+	    }
+	}
+      else
+	sym_addr = cur_addr;
+      
+      sym_pending = 1;
+      next = -1;
+
+      /* scan for program segments in the order of their offsets */
+      while (1)
+	{
+	  int prev = next;
+	  
+	  next = -1;
+	  for (i = 0; i < pu.elf->e_phnum; i++)
+	    {
+	      phdr = (Elf32_Phdr *)
+		(pu.elf->e_phoff + ((int) buffer)
+		 + (pu.elf->e_phentsize * i));
+	      if (phdr->p_type != PT_LOAD)
+		continue;
+
+	      /* Take the segments which come after the last one, by the
+		 offset and then by the index.  */
+	      if (prev >= 0
+		  && (phdr->p_offset < prev_offset
+		      || (phdr->p_offset == prev_offset && i <= prev)))
+		continue;
 	      
-	      memsiz = phdr->p_memsz;
-	      if (memaddr < RAW_ADDR (0x100000))
-		errnum = ERR_BELOW_1MB;
-
-	      /* If the memory range contains the entry address, get the
-		 physical address here.  */
-	      if (type == KERNEL_TYPE_MULTIBOOT
-		  && (unsigned) entry_addr >= phdr->p_vaddr
-		  && (unsigned) entry_addr < phdr->p_vaddr + memsiz)
-		real_entry_addr = (entry_func) ((unsigned) entry_addr
-						+ memaddr - phdr->p_vaddr);
-		
-	      /* make sure we only load what we're supposed to! */
-	      if (filesiz > memsiz)
-		filesiz = memsiz;
-	      /* mark memory as used */
-	      if (cur_addr < memaddr + memsiz)
-		cur_addr = memaddr + memsiz;
-	      printf (", <0x%x:0x%x:0x%x>", memaddr, filesiz,
-		      memsiz - filesiz);
-	      /* increment number of segments */
-	      loaded++;
-
-	      /* load the segment */
-	      if (memcheck (memaddr, memsiz)
-		  && grub_read ((char *) memaddr, filesiz) == filesiz)
+	      if (next < 0 || phdr->p_offset < next_offset)
 		{
-		  if (memsiz > filesiz)
-		    memset ((char *) (memaddr + filesiz), 0, memsiz - filesiz);
+		  next = i;
+		  next_offset = phdr->p_offset;
 		}
-	      else
-		break;
 	    }
+
+	  if (next < 0)
+	    break;
+	  
+	  phdr = (Elf32_Phdr *)
+	    (pu.elf->e_phoff + ((int) buffer)
+	     + (pu.elf->e_phentsize * next));
+	  prev_offset = next_offset;
+	  
+	  /* Read the symbols first, if they come before this segment.  */
+	  if (sym_pending && phdr->p_offset >= sym_start)
+	    {
+	      sym_pending = 0;
+	      if (! read_file_range ((char *) RAW_ADDR (sym_addr),
+				     sym_start, sym_end - sym_start,
+				     (char *) buffer, len))
+		symtab_err = 1;
+	    }
+
+	  filesiz = phdr->p_filesz;
+	  
+	  if (type == KERNEL_TYPE_FREEBSD || type == KERNEL_TYPE_NETBSD)
+	    memaddr = RAW_ADDR (phdr->p_paddr & 0xFFFFFF);
+	  else
+	    memaddr = RAW_ADDR (phdr->p_paddr);
+	  
+	  memsiz = phdr->p_memsz;
+	  if (memaddr < RAW_ADDR (0x100000))
+	    errnum = ERR_BELOW_1MB;
+
+	  /* If the memory range contains the entry address, get the
+	     physical address here.  */
+	  if (type == KERNEL_TYPE_MULTIBOOT
+	      && (unsigned) entry_addr >= phdr->p_vaddr
+	      && (unsigned) entry_addr < phdr->p_vaddr + memsiz)
+	    real_entry_addr = (entry_func) ((unsigned) entry_addr
+					    + memaddr - phdr->p_vaddr);
+	    
+	  /* make sure we only load what we're supposed to! */
+	  if (filesiz > memsiz)
+	    filesiz = memsiz;
+	  printf (", <0x%x:0x%x:0x%x>", memaddr, filesiz,
+		  memsiz - filesiz);
+	  /* increment number of segments */
+	  loaded++;
+
+	  /* load the segment */
+	  if (memcheck (memaddr, memsiz)
+	      && read_file_range ((char *) memaddr, phdr->p_offset, filesiz,
+				  (char *) buffer, len))
+	    {
+	      if (memsiz > filesiz)
+		memset ((char *) (memaddr + filesiz), 0, memsiz - filesiz);
+	    }
+	  else
+	    break;
 	}
 
       if (! errnum)
@@ -654,64 +949,74 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 	  else
 	    {
 	      /* Load ELF symbols.  */
-	      Elf32_Shdr *shdr = NULL;
-	      int tab_size, sec_size;
-	      int symtab_err = 0;
-
 	      mbi.syms.e.num = pu.elf->e_shnum;
 	      mbi.syms.e.size = pu.elf->e_shentsize;
 	      mbi.syms.e.shndx = pu.elf->e_shstrndx;
+
+	      if (sym_pending
+		  && ! read_file_range ((char *) RAW_ADDR (sym_addr),
+					sym_start, sym_end - sym_start,
+					(char *) buffer, len))
+		symtab_err = 1;
 	      
-	      /* We should align to a 4K boundary here for good measure.  */
-	      if (align_4k)
-		cur_addr = (cur_addr + 0xFFF) & 0xFFFFF000;
+	      mbi.syms.e.addr = sym_addr + (pu.elf->e_shoff - sym_start);
+	      shdr = (Elf32_Shdr *) RAW_ADDR (mbi.syms.e.addr);
+	      cur_addr = sym_addr + (sym_end - sym_start);
 	      
-	      tab_size = pu.elf->e_shentsize * pu.elf->e_shnum;
+	      if (! symtab_err)
+		printf (", shtab=0x%x", mbi.syms.e.addr);
 	      
-	      grub_seek (pu.elf->e_shoff);
-	      if (grub_read ((char *) RAW_ADDR (cur_addr), tab_size)
-		  == tab_size)
+	      /* Take the sections which are not loaded yet in the order
+		 of their offsets.  */
+	      while (! symtab_err)
 		{
-		  mbi.syms.e.addr = cur_addr;
-		  shdr = (Elf32_Shdr *) mbi.syms.e.addr;
-		  cur_addr += tab_size;
-		  
-		  printf (", shtab=0x%x", cur_addr);
-  		  
+		  next = -1;
 		  for (i = 0; i < mbi.syms.e.num; i++)
 		    {
-		      /* This section is a loaded section,
-			 so we don't care.  */
-		      if (shdr[i].sh_addr != 0)
+		      /* This section is a loaded section, so we don't
+			 care. Neither if it is empty.  */
+		      if (shdr[i].sh_addr != 0 || shdr[i].sh_size == 0)
 			continue;
-		      
-		      /* This section is empty, so we don't care.  */
-		      if (shdr[i].sh_size == 0)
-			continue;
-		      
-		      /* Align the section to a sh_addralign bits boundary.  */
-		      cur_addr = ((cur_addr + shdr[i].sh_addralign) & 
-				  - (int) shdr[i].sh_addralign);
-		      
-		      grub_seek (shdr[i].sh_offset);
-		      
-		      sec_size = shdr[i].sh_size;
-
-		      if (! (memcheck (cur_addr, sec_size)
-			     && (grub_read ((char *) RAW_ADDR (cur_addr),
-					    sec_size)
-				 == sec_size)))
-			{
-			  symtab_err = 1;
-			  break;
-			}
-		      
-		      shdr[i].sh_addr = cur_addr;
-		      cur_addr += sec_size;
+
+		      if (next < 0 || shdr[i].sh_offset < shdr[next].sh_offset)
+			next = i;
+		    }
+
+		  if (next < 0)
+		    break;
+		  
+		  sec_size = shdr[next].sh_size;
+
+		  /* Use the section in place, if it has been read with the
+		     section header table and it is aligned properly.  */
+		  if (shdr[next].sh_offset >= sym_start
+		      && shdr[next].sh_offset + sec_size <= pu.elf->e_shoff
+		      && (shdr[next].sh_addralign <= 1
+			  || ((sym_addr + shdr[next].sh_offset - sym_start)
+			      & (shdr[next].sh_addralign - 1)) == 0))
+		    {
+		      shdr[next].sh_addr = (sym_addr + shdr[next].sh_offset
+					    - sym_start);
+		      continue;
+		    }
+		  
+		  /* Align the section to a sh_addralign bits boundary.  */
+		  if (shdr[next].sh_addralign > 1)
+		    cur_addr = ((cur_addr + shdr[next].sh_addralign - 1)
+				& - (int) shdr[next].sh_addralign);
+		  
+		  if (! (memcheck (cur_addr, sec_size)
+			 && read_file_range ((char *) RAW_ADDR (cur_addr),
+					     shdr[next].sh_offset, sec_size,
+					     (char *) buffer, len)))
+		    {
+		      symtab_err = 1;
+		      break;
 		    }
+		  
+		  shdr[next].sh_addr = cur_addr;
+		  cur_addr += sec_size;
 		}
-	      else 
-		symtab_err = 1;
 	      
 	      if (mbi.syms.e.addr < RAW_ADDR(0x10000))
 		symtab_err = 1;
@@ -726,11 +1031,18 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 		  cur_addr = 0;
 		}
 	      else
-		mbi.flags |= MB_INFO_ELF_SHDR;
+		{
+		  mbi.flags |= MB_INFO_ELF_SHDR;
+		  mem_place_reserve (sym_addr, cur_addr - sym_addr);
+		}
 	    }
 	}
     }
 
+  /* Check the digest of the image, if required.  */
+  if (! errnum)
+    verify_file ();
+  
   if (! errnum)
     {
       grub_printf (", entry=0x%x]\n", (unsigned) entry_addr);
@@ -761,7 +1073,7 @@ load_image (char *kernel, char *arg, kernel_t suggested_type,
 int
 load_module (char *module, char *arg)
 {
-  int len;
+  int len, addr;
 
   /* if we are supposed to load on 4K boundaries */
   cur_addr = (cur_addr + 0xFFF) & 0xFFFFF000;
@@ -769,25 +1081,41 @@ load_module (char *module, char *arg)
   if (!grub_open (module))
     return 0;
 
-  len = grub_read ((char *) cur_addr, -1);
-  if (! len)
+  /* Pack the modules into the largest free ranges of the memory.  */
+#ifndef GRUB_UTIL
+  addr = mem_place (filemax, 0x1000, 0x100000, 0xFFFFFFFF, 0);
+  if (! addr)
     {
       grub_close ();
+      errnum = ERR_WONT_FIT;
       return 0;
     }
+#else
+  addr = cur_addr;
+#endif
 
-  printf ("   [Multiboot-module @ 0x%x, 0x%x bytes]\n", cur_addr, len);
+  len = grub_read ((char *) addr, -1);
+  if (! len || ! verify_file ())
+    {
+      grub_close ();
+      return 0;
+    }
+
+  printf ("   [Multiboot-module @ 0x%x, 0x%x bytes]\n", addr, len);
+  mem_place_reserve (addr, len);
 
   /* these two simply need to be set if any modules are loaded at all */
   mbi.flags |= MB_INFO_MODS;
   mbi.mods_addr = (int) mll;
 
   mll[mbi.mods_count].cmdline = (int) arg;
-  mll[mbi.mods_count].mod_start = cur_addr;
-  cur_addr += len;
-  mll[mbi.mods_count].mod_end = cur_addr;
+  mll[mbi.mods_count].mod_start = addr;
+  mll[mbi.mods_count].mod_end = addr + len;
   mll[mbi.mods_count].pad = 0;
 
+  if (cur_addr < addr + len)
+    cur_addr = addr + len;
+
   /* increment number of modules included */
   mbi.mods_count++;
 
@@ -811,30 +1139,35 @@ load_initrd (char *initrd)
   if (! grub_open (initrd))
     goto fail;
 
-  len = grub_read ((char *) cur_addr, -1);
-  if (! len)
-    {
-      grub_close ();
-      goto fail;
-    }
-
-  if (linux_mem_size)
-    moveto = linux_mem_size;
-  else
-    moveto = (mbi.mem_upper + 0x400) << 10;
-  
-  moveto = (moveto - len) & 0xfffff000;
   max_addr = (lh->header == LINUX_MAGIC_SIGNATURE && lh->version >= 0x0203
 	      ? lh->initrd_addr_max : LINUX_INITRD_MAX_ADDRESS);
-  if (moveto + len >= max_addr)
-    moveto = (max_addr - len) & 0xfffff000;
-  
+  if (linux_mem_size && linux_mem_size < max_addr)
+    max_addr = linux_mem_size;
+
   /* XXX: Linux 2.3.xx has a bug in the memory range check, so avoid
      the last page.
      XXX: Linux 2.2.xx has a bug in the memory range check, which is
      worse than that of Linux 2.3.xx, so avoid the last 64kb. *sigh*  */
-  moveto -= 0x10000;
-  memmove ((void *) RAW_ADDR (moveto), (void *) cur_addr, len);
+  max_addr -= 0x10000;
+
+  /* Put the initrd as high as possible, and read it there directly,
+     since its size is known already.  */
+  moveto = mem_place (filemax, 0x1000, 0x100000, max_addr, 1);
+  if (! moveto)
+    {
+      grub_close ();
+      errnum = ERR_WONT_FIT;
+      goto fail;
+    }
+
+  len = grub_read ((char *) RAW_ADDR (moveto), -1);
+  if (! len || ! verify_file ())
+    {
+      grub_close ();
+      goto fail;
+    }
+
+  mem_place_reserve (moveto, len);
 
   printf ("   [Linux-initrd @ 0x%x, 0x%x bytes]\n", moveto, len);
 
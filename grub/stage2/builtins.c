@@ -131,6 +131,273 @@ disk_read_print_func (int sector, int offset, int length)
 }
 
 
+/* blockcache */
+static int
+blockcache_func (char *arg, int flags)
+{
+  char *config = (char *) RAW_ADDR (0x100000);
+  struct blockcache_header *cache
+    = (struct blockcache_header *) RAW_ADDR (0x170000);
+  char *dummy = (char *) RAW_ADDR (0x180000);
+  struct blockcache_run *runs = (struct blockcache_run *) RAW_ADDR (0x190000);
+  int max_runs = (BLK_MAX_ADDR - BLK_BLKLIST_START) / BLK_BLKLIST_INC_VAL;
+  struct blockcache_record *record;
+  char *cache_file, *ptr, *end;
+  unsigned long root_drive = saved_drive;
+  unsigned long root_partition = saved_partition;
+  unsigned long tmp_drive = saved_drive;
+  unsigned long tmp_partition = saved_partition;
+  int num_runs, last_length, bad;
+  int len, i;
+
+  /* Collect the sectors of a file into runs.  Only whole sectors can
+     be recorded, except for the last one.  */
+  auto void disk_read_cache_func (int sector, int offset, int length);
+  void disk_read_cache_func (int sector, int offset, int length)
+    {
+      sector -= part_start;
+      if (offset != 0 || (num_runs && last_length != SECTOR_SIZE))
+	bad = 1;
+      else if (num_runs
+	       && (runs[num_runs - 1].start + runs[num_runs - 1].length
+		   == (unsigned int) sector))
+	runs[num_runs - 1].length++;
+      else if (num_runs < max_runs)
+	{
+	  runs[num_runs].start = sector;
+	  runs[num_runs].length = 1;
+	  num_runs++;
+	}
+      else
+	bad = 1;
+
+      last_length = length;
+    }
+
+  /* Map the file FILE, and return the number of the runs, or zero if
+     the file cannot be recorded.  */
+  auto int map_file (char *file);
+  int map_file (char *file)
+    {
+      num_runs = last_length = bad = 0;
+
+      no_decompression = 1;
+      if (! grub_open (file))
+	{
+	  no_decompression = 0;
+	  return 0;
+	}
+      no_decompression = 0;
+
+      if (current_drive != NETWORK_DRIVE && filemax > 0)
+	{
+	  disk_read_hook = disk_read_cache_func;
+	  disk_read_map_only = 1;
+	  grub_read (dummy, -1);
+	  disk_read_hook = 0;
+	  disk_read_map_only = 0;
+	}
+      else
+	bad = 1;
+
+      grub_close ();
+      return (errnum || bad) ? 0 : num_runs;
+    }
+
+  /* Add the file FILE, which is loaded by a boot entry, to the block
+     cache, unless it is already there.  */
+  auto void add_file (char *file);
+  void add_file (char *file)
+    {
+      struct blockcache_record *p;
+      int name_len, record_len;
+      char *name = file;
+
+      saved_drive = root_drive;
+      saved_partition = root_partition;
+      if (! map_file (file))
+	{
+	  errnum = ERR_NONE;
+	  return;
+	}
+
+      /* The name is looked up without the device.  */
+      if (*name == '(')
+	{
+	  while (*name && *name != ')')
+	    name++;
+	  if (*name)
+	    name++;
+	}
+
+      for (name_len = 0; name[name_len] && ! grub_isspace (name[name_len]);
+	   name_len++)
+	;
+
+      for (p = (struct blockcache_record *) (cache + 1);
+	   p < record;
+	   p = BLOCKCACHE_NEXT (p))
+	if (p->drive == current_drive && p->partition == current_partition
+	    && ! grub_memcmp (p->name, name, name_len) && ! p->name[name_len])
+	  return;
+
+      record_len = (sizeof (*record) + ((name_len + 4) & ~3)
+		    + num_runs * sizeof (struct blockcache_run));
+      if ((char *) record + record_len
+	  > (char *) cache + BLOCKCACHE_MAXLEN)
+	return;
+
+      grub_memset ((char *) record, 0, record_len);
+      record->len = record_len;
+      record->drive = current_drive;
+      record->partition = current_partition;
+      grub_strcpy (record->fsys, fsys_table[fsys_type].name);
+      record->size = filemax;
+      record->first = runs[0].start;
+      record->last = (runs[num_runs - 1].start
+		      + runs[num_runs - 1].length - 1);
+      record->runs = num_runs;
+      grub_memmove (record->name, name, name_len);
+      grub_memmove ((char *) BLOCKCACHE_RUNS (record), (char *) runs,
+		    num_runs * sizeof (struct blockcache_run));
+      record = BLOCKCACHE_NEXT (record);
+    }
+
+  cache_file = skip_to (0, arg);
+  if (! *cache_file)
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  /* Don't look up the files in the old block cache.  */
+  blockcache_load (0);
+
+  /* Read the configuration file.  */
+  if (! grub_open (arg))
+    return 1;
+
+  len = grub_read (config, 0x70000 - 1);
+  grub_close ();
+  if (errnum)
+    return 1;
+
+  config[len] = 0;
+
+  /* Record the files loaded by the commands in the configuration
+     file.  */
+  grub_memset ((char *) cache, 0, BLOCKCACHE_MAXLEN);
+  cache->magic = BLOCKCACHE_MAGIC;
+  record = (struct blockcache_record *) (cache + 1);
+  for (ptr = config; *ptr; ptr = end)
+    {
+      struct builtin *builtin;
+      char *cmd, *file;
+
+      for (end = ptr; *end && *end != '\n'; end++)
+	;
+      if (*end)
+	*end++ = 0;
+
+      cmd = ptr;
+      while (grub_isspace (*cmd))
+	cmd++;
+
+      file = skip_to (1, cmd);
+      builtin = find_command (cmd);
+      errnum = ERR_NONE;
+      if (! builtin)
+	continue;
+
+      if (builtin->flags & BUILTIN_TITLE)
+	{
+	  root_drive = tmp_drive;
+	  root_partition = tmp_partition;
+	}
+      else if (grub_strcmp (builtin->name, "root") == 0
+	       || grub_strcmp (builtin->name, "rootnoverify") == 0)
+	{
+	  if (set_device (file))
+	    {
+	      root_drive = current_drive;
+	      root_partition = current_partition;
+	    }
+
+	  errnum = ERR_NONE;
+	}
+      else if (grub_strcmp (builtin->name, "kernel") == 0)
+	{
+	  /* Skip the options.  */
+	  while (grub_memcmp (file, "--", 2) == 0)
+	    file = skip_to (0, file);
+
+	  add_file (file);
+	}
+      else if (grub_strcmp (builtin->name, "initrd") == 0
+	       || grub_strcmp (builtin->name, "module") == 0
+	       || grub_strcmp (builtin->name, "modulenounzip") == 0)
+	add_file (file);
+    }
+
+  saved_drive = tmp_drive;
+  saved_partition = tmp_partition;
+
+  cache->len = (char *) record - (char *) (cache + 1);
+  cache->checksum = blockcache_checksum ((char *) (cache + 1), cache->len);
+  len = (char *) record - (char *) cache;
+
+  /* Write the block cache to the sectors of the file CACHE_FILE, which
+     must be large enough.  */
+  if (! map_file (cache_file))
+    {
+      if (! errnum)
+	errnum = ERR_BAD_ARGUMENT;
+
+      return 1;
+    }
+
+  if (filemax < len)
+    {
+      errnum = ERR_WONT_FIT;
+      return 1;
+    }
+
+  if (filemax > BLOCKCACHE_MAXLEN)
+    filemax = BLOCKCACHE_MAXLEN;
+
+  len = (filemax + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  for (i = 0, ptr = (char *) cache; i < num_runs && len > 0; i++)
+    {
+      int count = runs[i].length;
+
+      if (count > len)
+	count = len;
+
+      if (! devwrite (runs[i].start, count, ptr))
+	return 1;
+
+      ptr += count * SECTOR_SIZE;
+      len -= count;
+    }
+
+  grub_printf (" %d bytes of the block cache are written.\n",
+	       cache->len + sizeof (*cache));
+  return 0;
+}
+
+static struct builtin builtin_blockcache =
+{
+  "blockcache",
+  blockcache_func,
+  BUILTIN_CMDLINE,
+  "blockcache CONFIG CACHE",
+  "Record the sectors of the files loaded by the boot entries in the"
+  " configuration file CONFIG into the file CACHE, so that they are"
+  " read without looking them up in the filesystems at boot time."
+  " CACHE must be a file of 32KB at least."
+};
+
+
 /* blocklist */
 static int
 blocklist_func (char *arg, int flags)
@@ -140,6 +407,7 @@ blocklist_func (char *arg, int flags)
   int num_sectors = 0;
   int num_entries = 0;
   int last_length = 0;
+  int saved_no_decompression = no_decompression;
 
   /* Collect contiguous blocks into one entry as many as possible,
      and print the blocklist notation on the screen.  */
@@ -186,9 +454,14 @@ blocklist_func (char *arg, int flags)
 	}
     }
 
-  /* Open the file.  */
+  /* Open the file.  The data is not read, so it must not be inflated
+     either.  */
+  no_decompression = 1;
   if (! grub_open (arg))
-    return 1;
+    {
+      no_decompression = saved_no_decompression;
+      return 1;
+    }
 
   /* Print the device name.  */
   grub_printf ("(%cd%d",
@@ -203,8 +476,9 @@ blocklist_func (char *arg, int flags)
   
   grub_printf (")");
 
-  /* Read in the whole file to DUMMY.  */
+  /* Map the whole file, without reading the data to DUMMY.  */
   disk_read_hook = disk_read_blocklist_func;
+  disk_read_map_only = 1;
   if (! grub_read (dummy, -1))
     goto fail;
 
@@ -218,6 +492,8 @@ blocklist_func (char *arg, int flags)
   
  fail:
   disk_read_hook = 0;
+  disk_read_map_only = 0;
+  no_decompression = saved_no_decompression;
   grub_close ();
   return errnum;
 }
@@ -477,6 +753,11 @@ static struct builtin builtin_chainloader =
 };
 
 
+/* The size of the chunks compared at a time, and the maximum number of
+   the differing ranges printed by the command "cmp".  */
+#define CMP_CHUNK_SIZE	0x80000
+#define CMP_MAX_RANGES	16
+
 /* This function could be used to debug new filesystem code. Put a file
    in the new filesystem and the same file in a well-tested filesystem.
    Then, run "cmp" with the files. If no output is obtained, probably
@@ -487,11 +768,55 @@ cmp_func (char *arg, int flags)
 {
   /* The filenames.  */
   char *file1, *file2;
-  /* The addresses.  */
+  /* The addresses of the chunks read from the files, and the size of
+     the chunks.  */
   char *addr1, *addr2;
-  int i;
-  /* The size of the file.  */
+  int chunk = CMP_CHUNK_SIZE;
+  /* The size of the files.  */
   int size;
+  /* The offset of the chunk.  */
+  int pos;
+  /* The range of the differing bytes, if LEN is positive.  */
+  int start = 0, len = 0;
+  /* The number of the differing ranges and bytes.  */
+  int ranges = 0, bytes = 0;
+
+  /* Report the differing range.  */
+  auto void cmp_report (void);
+  void cmp_report (void)
+    {
+      if (ranges < CMP_MAX_RANGES)
+	grub_printf ("Differ at the offset %d: %d bytes [%s], [%s]\n",
+		     start, len, file1, file2);
+
+      ranges++;
+      bytes += len;
+      len = 0;
+    }
+
+  /* Read COUNT bytes at OFFSET from FILE into ADDR.  Only a file can
+     be opened at a time, so FILE is opened for each chunk.  The data is
+     compared as it is on the disk, since seeking a compressed file
+     would decompress it from the start.  */
+  auto int cmp_read (char *file, char *addr, int offset, int count);
+  int cmp_read (char *file, char *addr, int offset, int count)
+    {
+      int ret = 0;
+
+      no_decompression = 1;
+      if (grub_open (file))
+	{
+	  if (filemax != size)
+	    errnum = ERR_FILELENGTH;
+	  else if (grub_seek (offset) == offset)
+	    ret = (grub_read (addr, count) == count);
+
+	  grub_close ();
+	}
+      no_decompression = 0;
+
+      return ret && ! errnum;
+    }
 
   /* Get the filenames from ARG.  */
   file1 = arg;
@@ -506,52 +831,111 @@ cmp_func (char *arg, int flags)
   nul_terminate (file1);
   nul_terminate (file2);
 
-  /* Read the whole data from FILE1.  */
-  addr1 = (char *) RAW_ADDR (0x100000);
+  /* Get the size of FILE1.  */
+  no_decompression = 1;
   if (! grub_open (file1))
-    return 1;
-  
-  /* Get the size.  */
-  size = filemax;
-  if (grub_read (addr1, -1) != size)
     {
-      grub_close ();
+      no_decompression = 0;
       return 1;
     }
-  
+
+  size = filemax;
   grub_close ();
 
-  /* Read the whole data from FILE2.  */
-  addr2 = addr1 + size;
+  /* Check if the size of FILE2 is equal to the one of FILE1.  */
   if (! grub_open (file2))
-    return 1;
+    {
+      no_decompression = 0;
+      return 1;
+    }
 
-  /* Check if the size of FILE2 is equal to the one of FILE2.  */
+  grub_close ();
+  no_decompression = 0;
   if (size != filemax)
     {
       grub_printf ("Differ in size: 0x%x [%s], 0x%x [%s]\n",
 		   size, file1, filemax, file2);
-      grub_close ();
       return 0;
     }
-  
-  if (! grub_read (addr2, -1))
-    {
-      grub_close ();
-      return 1;
-    }
-  
-  grub_close ();
 
-  /* Now compare ADDR1 with ADDR2.  */
-  for (i = 0; i < size; i++)
+  /* Use the halves of the upper memory below the arena for the
+     chunks, so that the files are opened as few times as possible,
+     without dropping the caches in the arena.  Each chunk but the
+     first is sought, which reads a sequential file such as one over
+     TFTP from the start again.  */
+  {
+    unsigned long avail = mbi.mem_upper;
+    unsigned long base = extmem_base ();
+
+    if (base > 0x100000 && ((base - 0x100000) >> 10) < avail)
+      avail = (base - 0x100000) >> 10;
+    if (avail > (0x80000000 >> 10))
+      avail = 0x80000000 >> 10;
+
+    if ((avail >> 1) > (CMP_CHUNK_SIZE >> 10))
+      chunk = ((avail >> 1) << 10) & ~0xFFF;
+  }
+
+  addr1 = (char *) RAW_ADDR (0x100000);
+  addr2 = (char *) RAW_ADDR (0x100000 + chunk);
+
+  /* Compare the files chunk by chunk, so that large files don't
+     overrun the memory.  */
+  for (pos = 0; pos < size; pos += chunk)
     {
-      if (addr1[i] != addr2[i])
-	grub_printf ("Differ at the offset %d: 0x%x [%s], 0x%x [%s]\n",
-		     i, (unsigned) addr1[i], file1,
-		     (unsigned) addr2[i], file2);
+      int n = size - pos;
+      int i = 0;
+
+      if (n > chunk)
+	n = chunk;
+
+      if (! cmp_read (file1, addr1, pos, n)
+	  || ! cmp_read (file2, addr2, pos, n))
+	{
+	  if (! errnum)
+	    errnum = ERR_READ;
+
+	  return 1;
+	}
+
+      while (i < n)
+	{
+	  if (! len)
+	    {
+	      /* Skip the same data a word at a time.  The chunks are
+		 aligned.  */
+	      while (i + (int) sizeof (unsigned long) <= n
+		     && (*(unsigned long *) (addr1 + i)
+			 == *(unsigned long *) (addr2 + i)))
+		i += sizeof (unsigned long);
+
+	      while (i < n && addr1[i] == addr2[i])
+		i++;
+
+	      if (i == n)
+		break;
+
+	      start = pos + i;
+	    }
+
+	  while (i < n && addr1[i] != addr2[i])
+	    i++;
+
+	  len = pos + i - start;
+	  if (i < n)
+	    cmp_report ();
+	}
     }
-  
+
+  if (len)
+    cmp_report ();
+
+  if (ranges > CMP_MAX_RANGES)
+    grub_printf ("... and %d more ranges\n", ranges - CMP_MAX_RANGES);
+
+  if (ranges)
+    grub_printf ("%d bytes differ in %d ranges\n", bytes, ranges);
+
   return 0;
 }
 
@@ -561,8 +945,8 @@ static struct builtin builtin_cmp =
   cmp_func,
   BUILTIN_CMDLINE,
   "cmp FILE1 FILE2",
-  "Compare the file FILE1 with the FILE2 and inform the different values"
-  " if any."
+  "Compare the file FILE1 with the FILE2 and inform the ranges of the"
+  " different bytes if any."
 };
 
 
@@ -1125,9 +1509,6 @@ embed_func (char *arg, int flags)
       sector = part_start + start_sector;
     }
 
-  /* Clear the cache.  */
-  buf_track = -1;
-
   /* Now perform the embedding.  */
   if (! devwrite (sector - part_start, size, stage1_5_buffer))
     return 1;
@@ -1748,10 +2129,12 @@ static int
 install_func (char *arg, int flags)
 {
   char *stage1_file, *dest_dev, *file, *addr;
-  char *stage1_buffer = (char *) RAW_ADDR (0x100000);
-  char *stage2_buffer = stage1_buffer + SECTOR_SIZE;
+  char *stage2_buffer = (char *) RAW_ADDR (0x100000);
   char *old_sect = stage2_buffer + SECTOR_SIZE;
-  char *stage2_first_buffer = old_sect + SECTOR_SIZE;
+  /* Stage 1 immediately precedes the first sector of Stage 2, so that
+     they can be written at once if they are contiguous on the disk.  */
+  char *stage1_buffer = old_sect + SECTOR_SIZE;
+  char *stage2_first_buffer = stage1_buffer + SECTOR_SIZE;
   char *stage2_second_buffer = stage2_first_buffer + SECTOR_SIZE;
   /* XXX: Probably SECTOR_SIZE is reasonable.  */
   char *config_filename = stage2_second_buffer + SECTOR_SIZE;
@@ -1775,6 +2158,8 @@ install_func (char *arg, int flags)
   int is_force_lba = 0;
   /* Was the last sector full? */
   int last_length = SECTOR_SIZE;
+  /* Was Stage 1 written together with Stage 2?  */
+  int is_stage1_written = 0;
   
 #ifdef GRUB_UTIL
   /* If the Stage 2 is in a partition mounted by an OS, this will store
@@ -2023,14 +2408,20 @@ install_func (char *arg, int flags)
   installlist = (int) stage2_first_buffer + SECTOR_SIZE + 4;
   installaddr += SECTOR_SIZE;
   
-  /* Read the whole of Stage2 except for the first sector.  */
-  grub_seek (SECTOR_SIZE);
+  /* Make the blocklist of Stage2 except for the first sector in one
+     pass. The second sector was read above, so just add it, and let the
+     filesystem map the rest without reading the data.  */
+  disk_read_blocklist_func (stage2_second_sector, 0, SECTOR_SIZE);
+  if (errnum)
+    goto fail;
 
   disk_read_hook = disk_read_blocklist_func;
-  if (! grub_read (dummy, -1))
-    goto fail;
-  
+  disk_read_map_only = 1;
+  grub_read (dummy, -1);
+  disk_read_map_only = 0;
   disk_read_hook = 0;
+  if (errnum)
+    goto fail;
   
   /* Find a string for the configuration filename.  */
   config_file_location = stage2_second_buffer + STAGE2_VER_STR_OFFS;
@@ -2220,35 +2611,57 @@ install_func (char *arg, int flags)
   else
 #endif /* GRUB_UTIL */
     {
-      /* The first.  */
+      /* Write contiguous sectors at once. If Stage 2 starts right after
+	 Stage 1 in the same partition, like a Stage 1.5 embedded after
+	 the MBR, Stage 1 is written together.  */
+      char *write_buffer = stage2_first_buffer;
+      int write_sector = stage2_first_sector - src_part_start;
+      int write_count = 1;
+      
       current_drive = src_drive;
       current_partition = src_partition;
 
       if (! open_partition ())
 	goto fail;
 
-      if (! devwrite (stage2_first_sector - src_part_start, 1,
-		      stage2_first_buffer))
+      if (dest_drive == src_drive && dest_partition == src_partition
+	  && write_sector == 1)
+	{
+	  write_buffer = stage1_buffer;
+	  write_sector = 0;
+	  write_count++;
+	  is_stage1_written = 1;
+	}
+
+      if (stage2_second_sector == stage2_first_sector + 1)
+	write_count++;
+      
+      if (! devwrite (write_sector, write_count, write_buffer))
 	goto fail;
 
-      if (! devwrite (stage2_second_sector - src_part_start, 1,
-		      stage2_second_buffer))
+      if (stage2_second_sector != stage2_first_sector + 1
+	  && ! devwrite (stage2_second_sector - src_part_start, 1,
+			 stage2_second_buffer))
 	goto fail;
     }
   
   /* Write the modified sector of Stage 1 to the disk.  */
-  current_drive = dest_drive;
-  current_partition = dest_partition;
-  if (! open_partition ())
-    goto fail;
+  if (! is_stage1_written)
+    {
+      current_drive = dest_drive;
+      current_partition = dest_partition;
+      if (! open_partition ())
+	goto fail;
 
-  devwrite (0, 1, stage1_buffer);
+      devwrite (0, 1, stage1_buffer);
+    }
 
  fail:
   if (is_open)
     grub_close ();
   
   disk_read_hook = 0;
+  disk_read_map_only = 0;
   
 #ifndef NO_DECOMPRESSION
   no_decompression = 0;
@@ -2390,7 +2803,12 @@ kernel_func (char *arg, int flags)
   grub_memmove (mb_cmdline, arg, len + 1);
   kernel_type = load_image (arg, mb_cmdline, suggested_type, load_flags);
   if (kernel_type == KERNEL_TYPE_NONE)
-    return 1;
+    {
+      /* Nothing is loaded, so the caches may use the extended memory
+	 again.  */
+      extmem_init ();
+      return 1;
+    }
 
   mb_cmdline += len + 1;
   return 0;
@@ -2790,7 +3208,6 @@ partnew_func (char *arg, int flags)
   PC_MBR_SIG (mbr) = PC_MBR_SIGNATURE;
   
   /* Write back the MBR to the disk.  */
-  buf_track = -1;
   if (! rawwrite (current_drive, 0, mbr))
     return 1;
 
@@ -2862,7 +3279,6 @@ parttype_func (char *arg, int flags)
 	  PC_SLICE_TYPE (mbr, entry) = new_type;
 	  
 	  /* Write back the MBR to the disk.  */
-	  buf_track = -1;
 	  if (! rawwrite (current_drive, offset, mbr))
 	    return 1;
 
@@ -3217,20 +3633,77 @@ static struct builtin builtin_rootnoverify =
 
 
 /* savedefault */
+
+#if !defined(SUPPORT_DISKLESS) && !defined(GRUB_UTIL)
+/* The sectors which contain the first bytes of the default file. They
+   are recorded when the file is read to load the menu, so savedefault
+   can write them without looking up the file again.  */
+static struct
+{
+  /* The root device when the file was read.  */
+  unsigned long root_drive;
+  unsigned long root_partition;
+  /* The drive which contains the file.  */
+  int drive;
+  /* The number of the sectors, or zero if unknown.  */
+  int count;
+  int sectors[2];
+  int offsets[2];
+  int lengths[2];
+  /* The contents of the sectors, and their checksum.  */
+  char data[2 * SECTOR_SIZE];
+  unsigned long checksum;
+} default_sectors;
+
+static unsigned long
+default_sectors_checksum (void)
+{
+  unsigned long sum = 0;
+  int i;
+
+  for (i = 0; i < default_sectors.count * SECTOR_SIZE; i++)
+    sum = ((sum << 1) | (sum >> 31)) ^ (unsigned char) default_sectors.data[i];
+
+  return sum;
+}
+
+/* Return true if the sectors recorded are still the same on the disk,
+   so that writing them doesn't overwrite newer data.  */
 static int
-savedefault_func (char *arg, int flags)
+default_sectors_on_disk (void)
+{
+  char sector[SECTOR_SIZE];
+  int i;
+
+  /* Read the disk itself, instead of the track buffer.  */
+  buf_track = -1;
+  for (i = 0; i < default_sectors.count; i++)
+    {
+      if (! rawread (default_sectors.drive, default_sectors.sectors[i], 0,
+		     SECTOR_SIZE, sector))
+	{
+	  errnum = ERR_NONE;
+	  return 0;
+	}
+
+      if (grub_memcmp (sector, default_sectors.data + i * SECTOR_SIZE,
+		       SECTOR_SIZE))
+	return 0;
+    }
+
+  return 1;
+}
+#endif /* ! SUPPORT_DISKLESS && ! GRUB_UTIL */
+
+/* Read the first LEN bytes of the default file in BUF, and record their
+   sectors for savedefault. Return the number of the bytes read.  */
+int
+read_default_file (char *buf, int len)
 {
+  int ret;
 #if !defined(SUPPORT_DISKLESS) && !defined(GRUB_UTIL)
-  unsigned long tmp_drive = saved_drive;
-  unsigned long tmp_partition = saved_partition;
-  char *default_file = (char *) DEFAULT_FILE_BUF;
-  char buf[10];
-  char sect[SECTOR_SIZE];
-  int entryno;
   int sector_count = 0;
-  int saved_sectors[2];
-  int saved_offsets[2];
-  int saved_lengths[2];
+  int i;
 
   /* Save sector information about at most two sectors.  */
   auto void disk_read_savesect_func (int sector, int offset, int length);
@@ -3238,12 +3711,62 @@ savedefault_func (char *arg, int flags)
     {
       if (sector_count < 2)
 	{
-	  saved_sectors[sector_count] = sector;
-	  saved_offsets[sector_count] = offset;
-	  saved_lengths[sector_count] = length;
+	  default_sectors.sectors[sector_count] = sector;
+	  default_sectors.offsets[sector_count] = offset;
+	  default_sectors.lengths[sector_count] = length;
 	}
       sector_count++;
     }
+
+  default_sectors.count = 0;
+#endif /* ! SUPPORT_DISKLESS && ! GRUB_UTIL */
+  
+  if (! grub_open ((char *) DEFAULT_FILE_BUF))
+    return 0;
+
+#if !defined(SUPPORT_DISKLESS) && !defined(GRUB_UTIL)
+  disk_read_hook = disk_read_savesect_func;
+#endif
+  ret = grub_read (buf, len);
+  disk_read_hook = 0;
+  grub_close ();
+
+#if !defined(SUPPORT_DISKLESS) && !defined(GRUB_UTIL)
+  /* A file spanned in more than two sectors is too fragmented.  */
+  if (ret != len || sector_count > 2
+      || current_drive == NETWORK_DRIVE
+      || buf_geom.sector_size != SECTOR_SIZE)
+    return ret;
+
+  /* Keep the contents of the sectors, which are likely to be still in
+     the track buffer.  */
+  for (i = 0; i < sector_count; i++)
+    if (! rawread (current_drive, default_sectors.sectors[i], 0,
+		   SECTOR_SIZE, default_sectors.data + i * SECTOR_SIZE))
+      {
+	errnum = ERR_NONE;
+	return ret;
+      }
+  
+  default_sectors.root_drive = saved_drive;
+  default_sectors.root_partition = saved_partition;
+  default_sectors.drive = current_drive;
+  default_sectors.count = sector_count;
+  default_sectors.checksum = default_sectors_checksum ();
+#endif /* ! SUPPORT_DISKLESS && ! GRUB_UTIL */
+
+  return ret;
+}
+
+static int
+savedefault_func (char *arg, int flags)
+{
+#if !defined(SUPPORT_DISKLESS) && !defined(GRUB_UTIL)
+  unsigned long tmp_drive = saved_drive;
+  unsigned long tmp_partition = saved_partition;
+  char buf[10];
+  int entryno;
+  int i, pos;
   
   /* This command is only useful when you boot an entry from the menu
      interface.  */
@@ -3258,7 +3781,6 @@ savedefault_func (char *arg, int flags)
     {
       if (grub_memcmp (arg, "fallback", sizeof ("fallback") - 1) == 0)
 	{
-	  int i;
 	  int index = 0;
 	  
 	  for (i = 0; i < MAX_FALLBACK_ENTRIES; i++)
@@ -3287,72 +3809,75 @@ savedefault_func (char *arg, int flags)
   else
     entryno = current_entryno;
 
-  /* Open the default file.  */
-  saved_drive = boot_drive;
-  saved_partition = install_partition;
-  if (grub_open (default_file))
-    {
-      int len;
+  /* Look up the default file again, only if the sectors recorded when
+     loading the menu cannot be used, or if they have been changed on
+     the disk since then.  */
+  if (! default_sectors.count
+      || default_sectors.root_drive != boot_drive
+      || default_sectors.root_partition != install_partition
+      || default_sectors.checksum != default_sectors_checksum ()
+      || ! default_sectors_on_disk ())
+    {
+      saved_drive = boot_drive;
+      saved_partition = install_partition;
       
-      disk_read_hook = disk_read_savesect_func;
-      len = grub_read (buf, sizeof (buf));
-      disk_read_hook = 0;
-      grub_close ();
-      
-      if (len != sizeof (buf))
+      if (read_default_file (buf, sizeof (buf)) != sizeof (buf))
 	{
 	  /* This is too small. Do not modify the file manually, please!  */
-	  errnum = ERR_READ;
+	  if (! errnum)
+	    errnum = ERR_READ;
 	  goto fail;
 	}
 
-      if (sector_count > 2)
+      if (! default_sectors.count)
 	{
 	  /* Is this possible?! Too fragmented!  */
 	  errnum = ERR_FSYS_CORRUPT;
 	  goto fail;
 	}
-      
-      /* Set up a string to be written.  */
-      grub_memset (buf, '\n', sizeof (buf));
-      grub_sprintf (buf, "%d", entryno);
-      
-      if (saved_lengths[0] < sizeof (buf))
-	{
-	  /* The file is anchored to another file and the first few bytes
-	     are spanned in two sectors. Uggh...  */
-	  if (! rawread (current_drive, saved_sectors[0], 0, SECTOR_SIZE,
-			 sect))
-	    goto fail;
-	  grub_memmove (sect + saved_offsets[0], buf, saved_lengths[0]);
-	  if (! rawwrite (current_drive, saved_sectors[0], sect))
-	    goto fail;
+    }
+  
+  /* Set up a string to be written.  */
+  grub_memset (buf, '\n', sizeof (buf));
+  grub_sprintf (buf, "%d", entryno);
 
-	  if (! rawread (current_drive, saved_sectors[1], 0, SECTOR_SIZE,
-			 sect))
-	    goto fail;
-	  grub_memmove (sect + saved_offsets[1],
-			buf + saved_lengths[0],
-			sizeof (buf) - saved_lengths[0]);
-	  if (! rawwrite (current_drive, saved_sectors[1], sect))
-	    goto fail;
-	}
-      else
-	{
-	  /* This is a simple case. It fits into a single sector.  */
-	  if (! rawread (current_drive, saved_sectors[0], 0, SECTOR_SIZE,
-			 sect))
-	    goto fail;
-	  grub_memmove (sect + saved_offsets[0], buf, sizeof (buf));
-	  if (! rawwrite (current_drive, saved_sectors[0], sect))
-	    goto fail;
-	}
+  /* The file may be anchored to another file, and the first few bytes
+     may be spanned in two sectors. Uggh...  */
+  for (i = 0, pos = 0; i < default_sectors.count; i++)
+    {
+      int len = default_sectors.lengths[i];
 
-      /* Clear the cache.  */
-      buf_track = -1;
+      if (len > (int) sizeof (buf) - pos)
+	len = (int) sizeof (buf) - pos;
+      grub_memmove (default_sectors.data + i * SECTOR_SIZE
+		    + default_sectors.offsets[i], buf + pos, len);
+      pos += len;
+    }
+
+  /* Write the sectors at once if they are contiguous.  */
+  if (default_sectors.count == 1
+      || default_sectors.sectors[1] == default_sectors.sectors[0] + 1)
+    {
+      if (! rawwrite_sectors (default_sectors.drive,
+			      default_sectors.sectors[0],
+			      default_sectors.count, default_sectors.data))
+	goto fail;
+    }
+  else
+    {
+      for (i = 0; i < default_sectors.count; i++)
+	if (! rawwrite (default_sectors.drive, default_sectors.sectors[i],
+			default_sectors.data + i * SECTOR_SIZE))
+	  goto fail;
     }
 
+  default_sectors.checksum = default_sectors_checksum ();
+  
  fail:
+  /* The sectors may be inconsistent with the disk.  */
+  if (errnum)
+    default_sectors.count = 0;
+  
   saved_drive = tmp_drive;
   saved_partition = tmp_partition;
   return errnum;
@@ -4633,6 +5158,205 @@ static struct builtin builtin_title =
 #endif
 };
 
+
+/* trace [--csv | --binary] [on [ENTRIES] | off | clear | dump [FILE]] */
+
+/* Format EVENT, which is the Nth event recorded, into BUF as a line
+   of CSV if CSV is nonzero, and for the screen otherwise.  */
+static void
+trace_format (char *buf, unsigned int n, struct trace_event *event,
+	      int csv)
+{
+  static char *types[] = { "open", "read", "devread", "disk" };
+  char *fsys = "-";
+  char *name = trace_name (event->file);
+
+  if (event->fsys < NUM_FSYS)
+    fsys = fsys_table[event->fsys].name;
+  if (! name)
+    name = "";
+
+  if (csv)
+    grub_sprintf (buf, "%u,%s,%u,%s,0x%x,%u,%u,%u,%u,%u,%u,%u,%s\n",
+		  n, types[event->type], event->file, fsys, event->drive,
+		  event->sector, event->offset, event->length,
+		  event->sectors, event->hit, event->ticks, event->elapsed,
+		  name);
+  else
+    grub_sprintf (buf, "%u %s file=%u %s drive=0x%x sector=%u+%u len=%u"
+		  " bios=%u t=%u+%u%s%s\n",
+		  n, types[event->type], event->file, fsys, event->drive,
+		  event->sector, event->offset, event->length,
+		  event->sectors, event->ticks, event->elapsed,
+		  event->type == TRACE_OPEN ? " " : "",
+		  event->type == TRACE_OPEN ? name : "");
+}
+
+static int
+trace_func (char *arg, int flags)
+{
+  struct trace_header header;
+  char buf[256];
+  char *file;
+  int csv = 0, binary = 0;
+  int i;
+
+  for (;;)
+    {
+      if (grub_memcmp (arg, "--csv", 5) == 0)
+	csv = 1;
+      else if (grub_memcmp (arg, "--binary", 8) == 0)
+	binary = 1;
+      else
+	break;
+
+      arg = skip_to (0, arg);
+    }
+
+  if (! *arg)
+    {
+      trace_header (&header);
+      grub_printf (" Tracing is %s, %u events kept, %u lost,"
+		   " room for %u events\n",
+		   trace_enabled ? "on" : "off",
+		   header.count, header.lost, header.size);
+      return 0;
+    }
+
+  if (grub_memcmp (arg, "on", 2) == 0)
+    {
+      char *p = skip_to (0, arg);
+      int size = 1024;
+
+      if (*p && ! safe_parse_maxint (&p, &size))
+	return 1;
+
+      if (! trace_on (size))
+	{
+	  errnum = ERR_WONT_FIT;
+	  return 1;
+	}
+    }
+  else if (grub_memcmp (arg, "off", 3) == 0)
+    trace_off ();
+  else if (grub_memcmp (arg, "clear", 5) == 0)
+    trace_clear ();
+  else if (grub_memcmp (arg, "dump", 4) == 0)
+    {
+      /* Don't record the dump itself.  */
+      int enabled = trace_enabled;
+
+      file = skip_to (0, arg);
+      trace_off ();
+      trace_header (&header);
+
+#ifdef GRUB_UTIL
+      if (*file)
+	{
+	  FILE *fp;
+	  int ok = 1;
+
+	  nul_terminate (file);
+	  fp = fopen (file, "w");
+	  if (! fp)
+	    {
+	      errnum = ERR_WRITE;
+	      return 1;
+	    }
+
+	  if (binary)
+	    {
+	      unsigned int serial;
+
+	      ok = fwrite (&header, sizeof (header), 1, fp) == 1;
+	      for (serial = header.files - header.names + 1;
+		   ok && serial <= header.files; serial++)
+		{
+		  char *name = trace_name (serial);
+		  int j;
+
+		  /* Pad the name with zeros.  */
+		  for (j = 0; j < TRACE_NAME_LEN - 1 && name[j]; j++)
+		    buf[j] = name[j];
+		  for (; j < TRACE_NAME_LEN; j++)
+		    buf[j] = 0;
+
+		  ok = (fwrite (&serial, sizeof (serial), 1, fp) == 1
+			&& fwrite (buf, TRACE_NAME_LEN, 1, fp) == 1);
+		}
+
+	      for (i = 0; ok && i < header.count; i++)
+		ok = fwrite (trace_get (i), sizeof (struct trace_event), 1,
+			     fp) == 1;
+	    }
+	  else
+	    {
+	      ok = fputs ("seq,type,file,fsys,drive,sector,offset,length,"
+			  "sectors,hit,ticks,elapsed,name\n", fp) != EOF;
+	      for (i = 0; ok && i < header.count; i++)
+		{
+		  trace_format (buf, header.lost + i, trace_get (i), 1);
+		  ok = fputs (buf, fp) != EOF;
+		}
+	    }
+
+	  if (fclose (fp) == EOF || ! ok)
+	    {
+	      errnum = ERR_WRITE;
+	      return 1;
+	    }
+	}
+      else
+#endif /* GRUB_UTIL */
+      if (*file || binary)
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  return 1;
+	}
+      else
+	{
+	  if (csv)
+	    grub_printf ("seq,type,file,fsys,drive,sector,offset,length,"
+			 "sectors,hit,ticks,elapsed,name\n");
+
+	  for (i = 0; i < header.count; i++)
+	    {
+	      trace_format (buf, header.lost + i, trace_get (i), csv);
+	      grub_printf ("%s", buf);
+	    }
+	}
+
+      if (enabled && header.size)
+	trace_on (header.size);
+
+      return 0;
+    }
+  else
+    {
+      errnum = ERR_BAD_ARGUMENT;
+      return 1;
+    }
+
+  grub_printf (" Tracing is now %s\n", trace_enabled ? "on" : "off");
+  return 0;
+}
+
+static struct builtin builtin_trace =
+{
+  "trace",
+  trace_func,
+  BUILTIN_CMDLINE | BUILTIN_HELP_LIST,
+  "trace [--csv | --binary] [on [ENTRIES] | off | clear | dump [FILE]]",
+  "Record the accesses to the files into a ring of ENTRIES events,"
+  " 1024 by default, in the extended memory: the files opened and read,"
+  " the sectors read by the filesystems, and the disk reads with the"
+  " track buffer hits and the BIOS ticks taken. `off' stops recording,"
+  " and `clear' forgets the events. `dump' prints the events, as CSV"
+  " if `--csv' is given. In the grub shell, `dump' writes them to the"
+  " file FILE, as CSV or, if `--binary' is given, in a binary format."
+  " With no argument, show the state of the trace."
+};
+
 
 /* unhide */
 static int
@@ -4666,6 +5390,7 @@ uppermem_func (char *arg, int flags)
     return 1;
 
   mbi.flags &= ~MB_INFO_MEM_MAP;
+  extmem_init ();
   return 0;
 }
 
@@ -4925,11 +5650,34 @@ static struct builtin builtin_vbeprobe =
   "Probe VBE information. If the mode number MODE is specified, show only"
   " the information about only the mode."
 };
+
+
+/* verify */
+static int
+verify_func (char *arg, int flags)
+{
+  if (! verify_load (arg))
+    return 1;
+
+  return 0;
+}
+
+static struct builtin builtin_verify =
+{
+  "verify",
+  verify_func,
+  BUILTIN_CMDLINE | BUILTIN_MENU | BUILTIN_HELP_LIST,
+  "verify FILE",
+  "Load the SHA-256 digests of files from FILE, in the format of"
+  " sha256sum. From now on, an OS image, a module or an initrd is loaded"
+  " only if it is listed in FILE and has the same digest."
+};
   
 
 /* The table of builtin commands. Sorted in dictionary order.  */
 struct builtin *builtin_table[] =
 {
+  &builtin_blockcache,
   &builtin_blocklist,
   &builtin_boot,
 #ifdef SUPPORT_NETBOOT
@@ -5012,9 +5760,11 @@ struct builtin *builtin_table[] =
 #endif /* SUPPORT_NETBOOT */
   &builtin_timeout,
   &builtin_title,
+  &builtin_trace,
   &builtin_unhide,
   &builtin_uppermem,
   &builtin_vbemode,
   &builtin_vbeprobe,
+  &builtin_verify,
   0
 };
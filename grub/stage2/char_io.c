@@ -1177,6 +1177,11 @@ grub_strlen (const char *str)
 int
 memcheck (int addr, int len)
 {
+#ifndef STAGE1_5
+  /* The data kept in the arena must not be overwritten.  */
+  cache_protect (addr, len);
+#endif
+  
 #ifdef GRUB_UTIL
   static int start_addr (void)
     {
@@ -1208,7 +1213,14 @@ memcheck (int addr, int len)
       || (addr < RAW_ADDR (0x100000)
 	  && RAW_ADDR (mbi.mem_lower * 1024) < (addr + len))
       || (addr >= RAW_ADDR (0x100000)
-	  && RAW_ADDR (mbi.mem_upper * 1024) < ((addr - 0x100000) + len)))
+	  && RAW_ADDR (mbi.mem_upper * 1024) < ((addr - 0x100000) + len)
+#if ! defined (STAGE1_5) && ! defined (GRUB_UTIL)
+	  /* The memory above the first hole is usable, if the memory
+	     map says so.  */
+	  && ! ((mbi.flags & MB_INFO_MEM_MAP)
+		&& mmap_avail_at (addr) >= (unsigned long) len)
+#endif
+	  ))
     errnum = ERR_WONT_FIT;
 
   return ! errnum;
@@ -1253,12 +1265,22 @@ grub_memmove (void *to, const void *from, int len)
 void *
 grub_memset (void *start, int c, int len)
 {
-  char *p = start;
-
-  if (memcheck ((int) start, len))
+  if (memcheck ((int) start, len) && len > 0)
     {
-      while (len -- > 0)
-	*p ++ = c;
+      /* Store four bytes at a time, as this is used to clear the BSS
+	 of a kernel, which can be large.  */
+      int d0, d1;
+
+      asm volatile ("cld\n\t"
+		    "rep\n\t"
+		    "stosl\n\t"
+		    "movl %4, %%ecx\n\t"
+		    "rep\n\t"
+		    "stosb"
+		    : "=&c" (d0), "=&D" (d1)
+		    : "a" ((c & 0xFF) * 0x01010101), "0" (len >> 2),
+		      "g" (len & 3), "1" (start)
+		    : "memory");
     }
 
   return errnum ? NULL : start;
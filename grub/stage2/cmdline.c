@@ -112,6 +112,10 @@ init_cmdline (void)
 
   /* Initialize the data for the builtin commands.  */
   init_builtins ();
+
+  /* The image loaded before, if any, has been forgotten by
+     init_builtins, so the arena may be used again.  */
+  extmem_init ();
 }
 
 /* Enter the command-line interface. HEAP is used for the command-line
@@ -59,6 +59,7 @@ char *err_list[] =
 {
   [ERR_NONE] = 0,
   [ERR_BAD_ARGUMENT] = "Invalid argument",
+  [ERR_BAD_DIGEST] = "File digest mismatch",
   [ERR_BAD_FILENAME] =
   "Filename must be either an absolute pathname or blocklist",
   [ERR_BAD_FILETYPE] = "Bad file or directory type",
@@ -82,6 +83,7 @@ char *err_list[] =
   [ERR_GEOM] = "Selected cylinder exceeds maximum supported by BIOS",
   [ERR_NEED_LX_KERNEL] = "Linux kernel must be loaded before initrd",
   [ERR_NEED_MB_KERNEL] = "Multiboot kernel must be loaded before modules",
+  [ERR_NO_DIGEST] = "No digest for the file",
   [ERR_NO_DISK] = "Selected disk does not exist",
   [ERR_NO_DISK_SPACE] = "No spare sectors on the disk",
   [ERR_NO_PART] = "No such partition",
@@ -106,41 +108,383 @@ static struct AddrRangeDesc fakemap[3] =
   {20, 0x1000000, 0, MB_ARD_MEMORY}
 };
 
+/* The available memory below 4GB in the BIOS memory map, as disjoint
+   ranges sorted in ascending order, with the ranges reserved by any
+   entry removed. END is not included, and is 0xFFFFFFFF at most.  */
+struct mem_region
+{
+  unsigned long start;
+  unsigned long end;
+};
+
+#define MEM_REGIONS_MAX		32
+static struct mem_region mem_regions[MEM_REGIONS_MAX];
+static int mem_region_count;
+
+/* Add the range from START to END to MEM_REGIONS, merging it with the
+   regions which overlap or touch it. If there is no room, the range is
+   dropped, which only wastes memory.  */
+static void
+mem_region_add (unsigned long start, unsigned long end)
+{
+  int i, j;
+
+  for (i = 0; i < mem_region_count && mem_regions[i].end < start; i++)
+    ;
+
+  for (j = i; j < mem_region_count && mem_regions[j].start <= end; j++)
+    {
+      if (start > mem_regions[j].start)
+	start = mem_regions[j].start;
+      if (end < mem_regions[j].end)
+	end = mem_regions[j].end;
+    }
+
+  if (i == j)
+    {
+      if (mem_region_count == MEM_REGIONS_MAX)
+	return;
+
+      grub_memmove ((char *) (mem_regions + i + 1), (char *) (mem_regions + i),
+		    (mem_region_count - i) * sizeof (struct mem_region));
+      mem_region_count++;
+    }
+  else
+    {
+      grub_memmove ((char *) (mem_regions + i + 1), (char *) (mem_regions + j),
+		    (mem_region_count - j) * sizeof (struct mem_region));
+      mem_region_count -= j - i - 1;
+    }
+
+  mem_regions[i].start = start;
+  mem_regions[i].end = end;
+}
+
+/* Remove the range from START to END from MEM_REGIONS.  */
+static void
+mem_region_remove (unsigned long start, unsigned long end)
+{
+  int i;
+
+  for (i = 0; i < mem_region_count; i++)
+    {
+      struct mem_region *r = mem_regions + i;
+
+      if (r->end <= start || r->start >= end)
+	continue;
+
+      if (r->start < start && r->end > end)
+	{
+	  /* Split the region. If there is no room, drop the upper
+	     part.  */
+	  if (mem_region_count < MEM_REGIONS_MAX)
+	    {
+	      grub_memmove ((char *) (r + 1), (char *) r,
+			    (mem_region_count - i) * sizeof (struct mem_region));
+	      mem_region_count++;
+	      r[1].start = end;
+	      i++;
+	    }
+
+	  r->end = start;
+	}
+      else if (r->start < start)
+	r->end = start;
+      else if (r->end > end)
+	r->start = end;
+      else
+	{
+	  grub_memmove ((char *) r, (char *) (r + 1),
+			(mem_region_count - i - 1)
+			* sizeof (struct mem_region));
+	  mem_region_count--;
+	  i--;
+	}
+    }
+}
+
 /* A big problem is that the memory areas aren't guaranteed to be:
    (1) contiguous, (2) sorted in ascending order, or (3) non-overlapping.
-   Thus this kludge.  */
-static unsigned long
-mmap_avail_at (unsigned long bottom)
+   So normalize the memory map into MEM_REGIONS once, instead of
+   scanning it whenever the memory is looked up. The available ranges
+   are added first, and the other ranges are removed from them, so that
+   a reserved range wins over an available one which overlaps it.  */
+static void
+mem_regions_init (void)
 {
-  unsigned long long top;
   unsigned long addr;
-  int cont;
-  
-  top = bottom;
-  do
+  int reserved;
+
+  mem_region_count = 0;
+  for (reserved = 0; reserved < 2; reserved++)
+    for (addr = mbi.mmap_addr;
+	 addr < mbi.mmap_addr + mbi.mmap_length;
+	 addr += *((unsigned long *) addr) + 4)
+      {
+	struct AddrRangeDesc *desc = (struct AddrRangeDesc *) addr;
+	unsigned long long start = desc->BaseAddr;
+	unsigned long long end = desc->BaseAddr + desc->Length;
+
+	if ((desc->Type != MB_ARD_MEMORY) != reserved
+	    || start >= end || start >= 0xFFFFFFFF)
+	  continue;
+
+	/* For now, GRUB assumes 32bits addresses, so...  */
+	if (end > 0xFFFFFFFF)
+	  end = 0xFFFFFFFF;
+
+	if (reserved)
+	  mem_region_remove ((unsigned long) start, (unsigned long) end);
+	else
+	  mem_region_add ((unsigned long) start, (unsigned long) end);
+      }
+}
+
+/* Return the size of the free memory contiguous from BOTTOM.  */
+unsigned long
+mmap_avail_at (unsigned long bottom)
+{
+  int i;
+
+  for (i = 0; i < mem_region_count; i++)
+    if (mem_regions[i].start <= bottom && bottom < mem_regions[i].end)
+      return mem_regions[i].end - bottom;
+
+  return 0;
+}
+
+/* The arena in the extended memory, from EXTMEM_BOTTOM to EXTMEM_TOP.
+   The memory is allocated from EXTMEM_CUR upward, and it is freed all
+   at once.  The callers keep EXTMEM_GENERATION together with their
+   memory, because the memory is lost whenever it changes.  */
+static unsigned long extmem_bottom, extmem_top, extmem_cur;
+int extmem_closed;
+unsigned long extmem_generation;
+
+/* Free all the memory in the arena.  */
+static void
+extmem_free_all (void)
+{
+  extmem_cur = extmem_bottom;
+  extmem_generation++;
+}
+
+/* Set up the arena in the largest free memory region above
+   EXTMEM_ARENA_START, and allow allocations.  The memory is kept if
+   the region doesn't change.  Nothing is done while an OS image is
+   loaded, since the arena may overlap it.  */
+void
+extmem_init (void)
+{
+  unsigned long bottom = 0, top = 0;
+  unsigned long upper_end = 0xFFFFFFFF;
+
+  if (kernel_type != KERNEL_TYPE_NONE)
+    return;
+
+  if (mbi.mem_upper < (upper_end - 0x100000) >> 10)
+    upper_end = 0x100000 + (mbi.mem_upper << 10);
+
+  if (mbi.flags & MB_INFO_MEM_MAP)
     {
-      for (cont = 0, addr = mbi.mmap_addr;
-	   addr < mbi.mmap_addr + mbi.mmap_length;
-	   addr += *((unsigned long *) addr) + 4)
+      int i;
+
+      for (i = 0; i < mem_region_count; i++)
 	{
-	  struct AddrRangeDesc *desc = (struct AddrRangeDesc *) addr;
-	  
-	  if (desc->Type == MB_ARD_MEMORY
-	      && desc->BaseAddr <= top
-	      && desc->BaseAddr + desc->Length > top)
+	  unsigned long start = mem_regions[i].start;
+
+	  if (start < EXTMEM_ARENA_START)
+	    start = EXTMEM_ARENA_START;
+
+	  if (start < mem_regions[i].end
+	      && mem_regions[i].end - start > top - bottom)
 	    {
-	      top = desc->BaseAddr + desc->Length;
-	      cont++;
+	      bottom = start;
+	      top = mem_regions[i].end;
 	    }
 	}
     }
-  while (cont);
+  else if (upper_end > EXTMEM_ARENA_START)
+    {
+      bottom = EXTMEM_ARENA_START;
+      top = upper_end;
+    }
 
-  /* For now, GRUB assumes 32bits addresses, so...  */
-  if (top > 0xFFFFFFFF)
-    top = 0xFFFFFFFF;
+  bottom = (bottom + 0xFFF) & ~0xFFF;
+  top &= ~0xFFF;
+  if (top < bottom)
+    top = bottom;
+  if (top - bottom > EXTMEM_ARENA_MAX)
+    bottom = top - EXTMEM_ARENA_MAX;
   
-  return (unsigned long) top - bottom;
+  if (extmem_closed || bottom != extmem_bottom || top != extmem_top)
+    {
+      extmem_bottom = bottom;
+      extmem_top = top;
+      extmem_closed = 0;
+      extmem_free_all ();
+    }
+}
+
+/* Allocate SIZE bytes in the arena.  Return zero if there is not enough
+   memory.  */
+void *
+extmem_alloc (int size)
+{
+  unsigned long addr = extmem_cur;
+  
+  size = (size + 0xF) & ~0xF;
+  if (extmem_closed || size <= 0 || extmem_top - extmem_cur < size)
+    return 0;
+
+  extmem_cur += size;
+  return (void *) RAW_ADDR (addr);
+}
+
+/* Free all the memory in the arena, and don't allocate any more until
+   extmem_init is called.  This must be called before an OS image is
+   loaded.  */
+void
+extmem_close (void)
+{
+  extmem_closed = 1;
+  extmem_free_all ();
+}
+
+/* Return the bottom of the arena, below which the memory can be used
+   without dropping the data kept there, or 0xFFFFFFFF if the arena is
+   empty.  */
+unsigned long
+extmem_base (void)
+{
+  if (extmem_closed || extmem_bottom >= extmem_top)
+    return 0xFFFFFFFF;
+
+  return extmem_bottom;
+}
+
+/* Make sure that the arena doesn't overlap LEN bytes at ADDR, which are
+   about to be overwritten.  If they do, all the memory is freed and
+   the arena is shrunk to above them.  */
+void
+extmem_protect (char *addr, int len)
+{
+  unsigned long start = (unsigned long) addr - RAW_ADDR (0);
+  unsigned long end = start + len;
+
+  if (extmem_closed || len <= 0
+      || start >= extmem_top || end <= extmem_bottom)
+    return;
+
+  if (end >= extmem_top)
+    extmem_bottom = extmem_top;
+  else
+    extmem_bottom = (end + 0xFFF) & ~0xFFF;
+  extmem_free_all ();
+}
+
+/* The memory used by the images loaded for the next boot, which
+   mem_place doesn't give out again. The kernel, the symbols and each
+   module take one range at most.  */
+#define MEM_USED_MAX		104
+static struct mem_region mem_used[MEM_USED_MAX];
+static int mem_used_count;
+
+/* Forget the memory used by the images loaded so far.  This is called
+   whenever a new kernel is loaded.  */
+void
+mem_place_reset (void)
+{
+  mem_used_count = 0;
+}
+
+/* Mark LEN bytes at ADDR as used by a loaded image.  */
+void
+mem_place_reserve (unsigned long addr, unsigned long len)
+{
+  if (len == 0 || mem_used_count == MEM_USED_MAX)
+    return;
+
+  mem_used[mem_used_count].start = addr;
+  mem_used[mem_used_count].end = (addr + len < addr
+				  ? 0xFFFFFFFF : addr + len);
+  mem_used_count++;
+}
+
+/* Find SIZE bytes of the free memory aligned to ALIGN, a power of two,
+   between LOW and HIGH, which are not used by the images loaded so far.
+   If TOP_DOWN is nonzero, return the highest such address, and
+   otherwise the lowest one in the largest free range. Return zero if
+   there is no room. Without the memory map, the upper memory is
+   used.  */
+unsigned long
+mem_place (unsigned long size, unsigned long align, unsigned long low,
+	   unsigned long high, int top_down)
+{
+  struct mem_region upper, *regions = mem_regions;
+  int count = mem_region_count;
+  unsigned long best = 0, best_len = 0;
+  int i, j, k;
+
+  if (! (mbi.flags & MB_INFO_MEM_MAP))
+    {
+      upper.start = 0x100000;
+      upper.end = 0xFFFFFFFF;
+      if (mbi.mem_upper < (upper.end - 0x100000) >> 10)
+	upper.end = 0x100000 + (mbi.mem_upper << 10);
+
+      regions = &upper;
+      count = 1;
+    }
+
+  for (i = 0; i < count; i++)
+    {
+      unsigned long bottom = regions[i].start;
+      unsigned long top = regions[i].end;
+
+      if (bottom < low)
+	bottom = low;
+      if (top > high)
+	top = high;
+
+      /* A free range starts at the bottom of the region or at the end
+	 of a used range, and ends at the start of the next used range
+	 or at the top of the region.  */
+      for (j = -1; j < mem_used_count; j++)
+	{
+	  unsigned long start = j < 0 ? bottom : mem_used[j].end;
+	  unsigned long end = top;
+
+	  start = (start + align - 1) & ~(align - 1);
+	  if (start < bottom || start >= top)
+	    continue;
+
+	  for (k = 0; k < mem_used_count; k++)
+	    {
+	      if (mem_used[k].start <= start && start < mem_used[k].end)
+		break;
+
+	      if (mem_used[k].start > start && mem_used[k].start < end)
+		end = mem_used[k].start;
+	    }
+
+	  if (k < mem_used_count || end - start < size)
+	    continue;
+
+	  if (top_down)
+	    {
+	      if (((end - size) & ~(align - 1)) > best)
+		best = (end - size) & ~(align - 1);
+	    }
+	  else if (end - start > best_len)
+	    {
+	      best = start;
+	      best_len = end - start;
+	    }
+	}
+    }
+
+  return best;
 }
 #endif /* ! STAGE1_5 */
 
@@ -198,6 +542,8 @@ init_bios_info (void)
     }
   while (cont);
 
+  mem_regions_init ();
+
   if (mbi.mmap_length)
     {
       unsigned long long max_addr;
@@ -246,6 +592,7 @@ init_bios_info (void)
 	  fakemap[0].Length = (mbi.mem_lower << 10);
 	  fakemap[1].Length = (memtmp << 10);
 	  fakemap[2].Length = cont;
+	  mem_regions_init ();
 	}
 
       mbi.mem_upper = memtmp;
@@ -321,6 +668,9 @@ init_bios_info (void)
   if (apm_bios_info.version)
     mbi.flags |= MB_INFO_APM_TABLE;
 
+  /* Set up the arena for the caches.  */
+  extmem_init ();
+
 #endif /* STAGE1_5 */
 
   /* Set boot drive and partition.  */
@@ -21,6 +21,7 @@
 
 #include <shared.h>
 #include <filesys.h>
+#include <sha256.h>
 
 #ifdef SUPPORT_NETBOOT
 # define GRUB	1
@@ -36,15 +37,32 @@ void (*disk_read_hook) (int, int, int) = NULL;
 void (*disk_read_func) (int, int, int) = NULL;
 
 #ifndef STAGE1_5
+/* If non-zero, the sectors passed to DISK_READ_FUNC are not read, so
+   that only the sector map of a file is obtained.  */
+int disk_read_map_only = 0;
+
+/* If non-zero, the file accesses are recorded in the trace.  */
+int trace_enabled = 0;
+/* The number of the sectors read by the BIOS, which tells how many of
+   them an event took.  */
+static unsigned int trace_sectors;
+
+static void trace_begin (struct trace_event *event, int type);
+static void trace_end (struct trace_event *event);
+
 int print_possibilities;
 
 static int do_completion;
 static int unique;
 static char *unique_string;
 
+#else /* STAGE1_5 */
+/* Stage 1.5 always reads the data.  */
+# define disk_read_map_only	0
 #endif
 
 int fsmax;
+#ifndef STAGE1_5
 struct fsys_entry fsys_table[NUM_FSYS + 1] =
 {
   /* TFTP should come first because others don't handle net device.  */
@@ -85,6 +103,7 @@ struct fsys_entry fsys_table[NUM_FSYS + 1] =
 # endif
   {0, 0, 0, 0, 0, 0}
 };
+#endif /* ! STAGE1_5 */
 
 
 /* These have the same format as "boot_drive" and "install_partition", but
@@ -123,6 +142,12 @@ int buf_drive = -1;
 int buf_track;
 struct geometry buf_geom;
 
+#ifndef STAGE1_5
+/* Incremented on each write to a disk, so that the caches of the disk
+   contents can tell whether they may be stale.  */
+unsigned long disk_write_count;
+#endif /* ! STAGE1_5 */
+
 /* filesystem common variables */
 int filepos;
 int filemax;
@@ -136,11 +161,28 @@ log2 (unsigned long word)
   return word;
 }
 
+/* Check if the sector 0 in SECT is of an EZ-Drive disk, which maps the
+   sector 0 to the sector 1.  */
+#define IS_EZD_SECTOR(sect) \
+  (PC_SLICE_TYPE (sect, 0) == PC_SLICE_TYPE_EZD \
+   || PC_SLICE_TYPE (sect, 1) == PC_SLICE_TYPE_EZD \
+   || PC_SLICE_TYPE (sect, 2) == PC_SLICE_TYPE_EZD \
+   || PC_SLICE_TYPE (sect, 3) == PC_SLICE_TYPE_EZD)
+
+#ifndef STAGE1_5
+/* The result of the EZ-Drive check for EZD_DRIVE. It is valid only
+   while BUF_DRIVE is EZD_DRIVE, so it is checked again once the
+   geometry of the drive is discarded.  */
+static int ezd_drive = -1;
+static int ezd_remap;
+#endif /* ! STAGE1_5 */
+
 int
 rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
 {
   int slen, sectors_per_vtrack;
   int sector_size_bits = log2 (buf_geom.sector_size);
+  int map_only = disk_read_func && disk_read_map_only;
 
   if (byte_len <= 0)
     return 1;
@@ -149,6 +191,10 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
     {
       int soff, num_sect, track, size = byte_len;
       char *bufaddr;
+#ifndef STAGE1_5
+      struct trace_event event;
+      int traced = trace_enabled && ! map_only;
+#endif
 
       /*
        *  Check track buffer.  If it isn't valid or it is from the
@@ -172,24 +218,50 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
 	  errnum = ERR_GEOM;
 	  return 0;
 	}
+
+#ifndef STAGE1_5
+      if (traced)
+	trace_begin (&event, TRACE_DISK);
+#endif
       
       slen = ((byte_offset + byte_len + buf_geom.sector_size - 1)
 	      >> sector_size_bits);
       
-      /* Eliminate a buffer overflow.  */
-      if ((buf_geom.sectors << sector_size_bits) > BUFFERLEN)
-	sectors_per_vtrack = (BUFFERLEN >> sector_size_bits);
+      if (buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	{
+	  /* LBA has no notion of tracks, so fill the whole buffer from
+	     SECTOR on, unless the buffer already contains SECTOR. This
+	     saves a BIOS call for every track boundary.  */
+	  sectors_per_vtrack = (BUFFERLEN >> sector_size_bits);
+	  if (buf_track >= 0 && sector >= buf_track
+	      && sector < buf_track + sectors_per_vtrack)
+	    track = buf_track;
+	  else
+	    track = sector;
+
+	  /* Don't read beyond the end of the disk.  */
+	  if (sectors_per_vtrack > buf_geom.total_sectors - track)
+	    sectors_per_vtrack = buf_geom.total_sectors - track;
+
+	  soff = sector - track;
+	}
       else
-	sectors_per_vtrack = buf_geom.sectors;
+	{
+	  /* Eliminate a buffer overflow.  */
+	  if ((buf_geom.sectors << sector_size_bits) > BUFFERLEN)
+	    sectors_per_vtrack = (BUFFERLEN >> sector_size_bits);
+	  else
+	    sectors_per_vtrack = buf_geom.sectors;
       
-      /* Get the first sector of track.  */
-      soff = sector % sectors_per_vtrack;
-      track = sector - soff;
+	  /* Get the first sector of track.  */
+	  soff = sector % sectors_per_vtrack;
+	  track = sector - soff;
+	}
       num_sect = sectors_per_vtrack - soff;
       bufaddr = ((char *) BUFFERADDR
 		 + (soff << sector_size_bits) + byte_offset);
 
-      if (track != buf_track)
+      if (track != buf_track && ! map_only)
 	{
 	  int bios_err, read_start = track, read_len = sectors_per_vtrack;
 
@@ -205,6 +277,9 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
 	      bufaddr = (char *) BUFFERADDR + byte_offset;
 	    }
 
+#ifndef STAGE1_5
+	  trace_sectors += read_len;
+#endif
 	  bios_err = biosdisk (BIOSDISK_READ, drive, &buf_geom,
 			       read_start, read_len, BUFFERSEG);
 	  if (bios_err)
@@ -227,14 +302,22 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
 		  bufaddr = (char *) BUFFERADDR + byte_offset;
 		}
 	    }
-	  else
+	  else if (read_start == track)
 	    buf_track = track;
+	  else
+	    /* The buffer doesn't start at the track boundary, so it
+	       cannot be used as a cache.  */
+	    buf_track = -1;
 
-	  if ((buf_track == 0 || sector == 0)
-	      && (PC_SLICE_TYPE (BUFFERADDR, 0) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 1) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 2) == PC_SLICE_TYPE_EZD
-		  || PC_SLICE_TYPE (BUFFERADDR, 3) == PC_SLICE_TYPE_EZD))
+#ifndef STAGE1_5
+	  if ((buf_track == 0 || sector == 0) && ! errnum)
+	    {
+	      ezd_drive = drive;
+	      ezd_remap = IS_EZD_SECTOR (BUFFERADDR);
+	    }
+#endif /* ! STAGE1_5 */
+	  
+	  if ((buf_track == 0 || sector == 0) && IS_EZD_SECTOR (BUFFERADDR))
 	    {
 	      /* This is a EZD disk map sector 0 to sector 1 */
 	      if (buf_track == 0 || slen >= 2)
@@ -256,6 +339,17 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
       if (size > ((num_sect << sector_size_bits) - byte_offset))
 	size = (num_sect << sector_size_bits) - byte_offset;
 
+#ifndef STAGE1_5
+      if (traced)
+	{
+	  event.drive = drive;
+	  event.sector = sector;
+	  event.offset = byte_offset;
+	  event.length = size;
+	  trace_end (&event);
+	}
+#endif
+
       /*
        *  Instrumentation to tell which sectors were read and used.
        */
@@ -278,7 +372,8 @@ rawread (int drive, int sector, int byte_offset, int byte_len, char *buf)
 	    }
 	}
 
-      grub_memmove (buf, bufaddr, size);
+      if (! map_only)
+	grub_memmove (buf, bufaddr, size);
 
       buf += size;
       byte_len -= size;
@@ -313,6 +408,21 @@ devread (int sector, int byte_offset, int byte_len, char *buf)
 #if !defined(STAGE1_5)
   if (disk_read_hook && debug)
     printf ("<%d, %d, %d>", sector, byte_offset, byte_len);
+
+  if (trace_enabled && ! (disk_read_func && disk_read_map_only))
+    {
+      struct trace_event event;
+      int ret;
+
+      trace_begin (&event, TRACE_DEVREAD);
+      event.sector = sector;
+      event.offset = byte_offset;
+      event.length = byte_len;
+      ret = rawread (current_drive, part_start + sector, byte_offset,
+		     byte_len, buf);
+      trace_end (&event);
+      return ret;
+    }
 #endif /* !STAGE1_5 */
 
   /*
@@ -329,39 +439,130 @@ devread (int sector, int byte_offset, int byte_len, char *buf)
 }
 
 #ifndef STAGE1_5
+/* Return the number of the sectors which the track buffer holds from
+   BUF_TRACK on, in the same way as rawread fills it.  */
+static int
+buf_track_sectors (void)
+{
+  int len = BUFFERLEN >> SECTOR_BITS;
+  
+  if (buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+    {
+      if (len > buf_geom.total_sectors - buf_track)
+	len = buf_geom.total_sectors - buf_track;
+    }
+  else if (len > buf_geom.sectors)
+    len = buf_geom.sectors;
+
+  return len;
+}
+
+/* Write COUNT sectors in BUF to SECTOR of DRIVE. Contiguous sectors are
+   passed to the BIOS at once, and the sectors in the track buffer are
+   updated instead of discarded.  */
 int
-rawwrite (int drive, int sector, char *buf)
+rawwrite_sectors (int drive, int sector, int count, char *buf)
 {
-  if (sector == 0)
+  disk_write_count++;
+  
+  if (sector == 0 && count > 0)
     {
-      if (biosdisk (BIOSDISK_READ, drive, &buf_geom, 0, 1, SCRATCHSEG))
+      if (ezd_drive != drive || buf_drive != drive)
 	{
-	  errnum = ERR_WRITE;
-	  return 0;
+	  if (biosdisk (BIOSDISK_READ, drive, &buf_geom, 0, 1, SCRATCHSEG))
+	    {
+	      errnum = ERR_WRITE;
+	      return 0;
+	    }
+	  
+	  ezd_drive = drive;
+	  ezd_remap = IS_EZD_SECTOR (SCRATCHADDR);
 	}
 
-      if (PC_SLICE_TYPE (SCRATCHADDR, 0) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 1) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 2) == PC_SLICE_TYPE_EZD
-	  || PC_SLICE_TYPE (SCRATCHADDR, 3) == PC_SLICE_TYPE_EZD)
-	sector = 1;
+      if (ezd_remap)
+	{
+	  /* The sector 0 is mapped to the sector 1.  */
+	  if (! rawwrite_sectors (drive, 1, 1, buf))
+	    return 0;
+
+	  sector++;
+	  count--;
+	  buf += SECTOR_SIZE;
+	}
+      else
+	/* The new sector 0 may change the result.  */
+	ezd_remap = IS_EZD_SECTOR (buf);
     }
+
+  /* On an EZ-Drive disk, the track buffer of the track 0 holds the
+     sector 1 as the sector 0 as well, so don't try to update it.  */
+  if (buf_drive == drive && buf_track == 0
+      && (ezd_drive != drive || ezd_remap))
+    buf_track = -1;
   
-  memmove ((char *) SCRATCHADDR, buf, SECTOR_SIZE);
-  if (biosdisk (BIOSDISK_WRITE, drive, &buf_geom,
-		sector, 1, SCRATCHSEG))
+  while (count > 0)
     {
-      errnum = ERR_WRITE;
-      return 0;
-    }
+      int num = count;
+      int seg;
+      
+      if (buf_track >= 0 && buf_drive == drive
+	  && buf_geom.sector_size == SECTOR_SIZE
+	  && sector >= buf_track
+	  && sector + count <= buf_track + buf_track_sectors ())
+	{
+	  /* All of the sectors are in the track buffer, so update them,
+	     and write them from there.  */
+	  int soff = sector - buf_track;
+	  
+	  memmove ((char *) BUFFERADDR + (soff << SECTOR_BITS), buf,
+		   count << SECTOR_BITS);
+	  seg = BUFFERSEG + (soff << (SECTOR_BITS - 4));
+	}
+      else if (count == 1)
+	{
+	  /* A single sector doesn't need to touch the track buffer.  */
+	  memmove ((char *) SCRATCHADDR, buf, SECTOR_SIZE);
+	  seg = SCRATCHSEG;
+	}
+      else
+	{
+	  /* Pass the sectors through the track buffer, which is lost.  */
+	  buf_track = -1;
 
-  if (sector - sector % buf_geom.sectors == buf_track)
-    /* Clear the cache.  */
-    buf_track = -1;
+	  if (num > (BUFFERLEN >> SECTOR_BITS))
+	    num = BUFFERLEN >> SECTOR_BITS;
+
+	  /* CHS accesses must not cross a track boundary.  */
+	  if (! (buf_geom.flags & BIOSDISK_FLAG_LBA_EXTENSION)
+	      && num > buf_geom.sectors - sector % buf_geom.sectors)
+	    num = buf_geom.sectors - sector % buf_geom.sectors;
+
+	  memmove ((char *) BUFFERADDR, buf, num << SECTOR_BITS);
+	  seg = BUFFERSEG;
+	}
+
+      if (biosdisk (BIOSDISK_WRITE, drive, &buf_geom, sector, num, seg))
+	{
+	  /* The track buffer may not match the disk any longer.  */
+	  buf_track = -1;
+	  errnum = ERR_WRITE;
+	  return 0;
+	}
+
+      sector += num;
+      count -= num;
+      buf += num << SECTOR_BITS;
+    }
 
   return 1;
 }
 
+int
+rawwrite (int drive, int sector, char *buf)
+{
+  return rawwrite_sectors (drive, sector, 1, buf);
+}
+
 int
 devwrite (int sector, int sector_count, char *buf)
 {
@@ -372,24 +573,16 @@ devwrite (int sector, int sector_count, char *buf)
       /* If the grub shell is running under Linux and the user wants to
 	 embed a Stage 1.5 into a partition instead of a MBR, use system
 	 calls directly instead of biosdisk, because of the bug in
-	 Linux. *sigh*  */
+	 Linux. *sigh* The track buffer doesn't see the write.  */
+      buf_track = -1;
+      disk_write_count++;
       return write_to_partition (device_map, current_drive, current_partition,
 				 sector, sector_count, buf);
     }
   else
 #endif /* GRUB_UTIL && __linux__ */
-    {
-      int i;
-      
-      for (i = 0; i < sector_count; i++)
-	{
-	  if (! rawwrite (current_drive, part_start + sector + i, 
-			  buf + (i << SECTOR_BITS)))
-	      return 0;
-
-	}
-      return 1;
-    }
+    return rawwrite_sectors (current_drive, part_start + sector,
+			     sector_count, buf);
 }
 
 static int
@@ -426,7 +619,7 @@ attempt_mount (void)
     errnum = ERR_FSYS_MOUNT;
 #else
   fsys_type = 0;
-  if ((*(fsys_table[fsys_type].mount_func)) () != 1)
+  if (FSYS_MOUNT_FUNC () != 1)
     {
       fsys_type = NUM_FSYS;
       errnum = ERR_FSYS_MOUNT;
@@ -1534,13 +1727,958 @@ print_completions (int is_filename, int is_completion)
  *  This is the generic file open function.
  */
 
+#ifndef STAGE1_5
+/* The files read ahead while the menu counts down.  They are kept in
+   the arena, as long as arena_kept returns true, and grub_read takes
+   the data from there when one of them is opened again.  */
+struct readahead_file
+{
+  struct readahead_file *next;
+  unsigned long drive;
+  unsigned long partition;
+  /* The size of the file.  */
+  int size;
+  /* The number of the bytes read ahead so far.  */
+  int len;
+  char *data;
+  char name[0];
+};
+
+static struct readahead_file *readahead_files;
+static unsigned long readahead_generation;
+/* The file opened by grub_open, if it is read ahead.  */
+static struct readahead_file *readahead_current;
+/* The file being read ahead.  */
+static struct readahead_file *readahead_target;
+/* The name of the file last opened by grub_open.  */
+static char *readahead_name;
+/* Set while the data of READAHEAD_TARGET is being read.  */
+static int readahead_filling;
+
+/* Return the length of the file name NAME, which ends with a space.  */
+static int
+readahead_name_len (char *name)
+{
+  int len = 0;
+
+  while (name[len] && ! isspace (name[len]))
+    len++;
+
+  return len;
+}
+
+/* The block cache loaded by blockcache_load, kept in the arena.  */
+static struct blockcache_header *blockcache;
+static unsigned long blockcache_generation;
+
+/* The trace, kept in the arena.  The events are recorded in a ring, so
+   that the latest ones are kept.  */
+struct trace_ring
+{
+  /* The number of the events which the ring holds.  */
+  unsigned int size;
+  /* The number of the events recorded since the trace was cleared.  */
+  unsigned int recorded;
+  /* The names of the files opened last, indexed by the serial number
+     modulo TRACE_NAMES.  */
+  char names[TRACE_NAMES][TRACE_NAME_LEN];
+  struct trace_event events[0];
+};
+
+static struct trace_ring *trace_ring;
+static unsigned long trace_generation;
+/* The serial number of the file opened last.  */
+static unsigned int trace_file;
+/* Set while grub_open or grub_read is traced, so that the calls made
+   by itself aren't recorded separately.  */
+static int trace_busy;
+
+/* Return true if the data allocated in the arena while the generation
+   was GENERATION may be used.  The arena is closed just before an OS
+   image is loaded, but the data is still intact, because cache_protect
+   drops any of it about to be overwritten.  */
+static int
+arena_kept (unsigned long generation)
+{
+  return (generation == extmem_generation
+	  || (extmem_closed && generation + 1 == extmem_generation));
+}
+
+/* Set READAHEAD_CURRENT to the file read ahead whose name is NAME on
+   the current partition, if any.  */
+static void
+readahead_lookup (char *name)
+{
+  struct readahead_file *file;
+  int len = readahead_name_len (name);
+
+  readahead_name = name;
+  if (! arena_kept (readahead_generation))
+    readahead_files = 0;
+
+  for (file = readahead_files; file; file = file->next)
+    if (file->drive == current_drive
+	&& file->partition == current_partition
+	&& file->size == filemax
+	&& ! grub_memcmp (file->name, name, len) && ! file->name[len])
+      {
+	readahead_current = file;
+	break;
+      }
+}
+
+/* Copy the data read ahead at FILEPOS of the current file into BUF, up
+   to LEN bytes.  Return the number of the bytes copied.  */
+static int
+readahead_read (char *buf, int len)
+{
+  struct readahead_file *file = readahead_current;
+
+  if (! arena_kept (readahead_generation))
+    {
+      readahead_files = readahead_current = 0;
+      return 0;
+    }
+
+  if (len > file->len - filepos)
+    len = file->len - filepos;
+  if (len <= 0)
+    return 0;
+
+  /* The data is moved correctly, even if BUF overlaps it, and then
+     the file is dropped by cache_protect.  */
+  grub_memmove (buf, file->data + filepos, len);
+  if (errnum)
+    return 0;
+
+  filepos += len;
+  return len;
+}
+
+/* Drop the files read ahead and the block cache, if they overlap LEN
+   bytes at ADDR, since they are about to be overwritten.  */
+void
+cache_protect (int addr, int len)
+{
+  struct readahead_file **p = &readahead_files;
+
+  if (readahead_filling || len <= 0)
+    return;
+
+  if (blockcache
+      && (unsigned long) addr < ((unsigned long) (blockcache + 1)
+				 + blockcache->len)
+      && (unsigned long) addr + len > (unsigned long) blockcache)
+    blockcache = 0;
+
+  if (trace_ring
+      && (unsigned long) addr < (unsigned long) (trace_ring->events
+						 + trace_ring->size)
+      && (unsigned long) addr + len > (unsigned long) trace_ring)
+    {
+      trace_ring = 0;
+      trace_enabled = 0;
+    }
+
+  while (*p)
+    {
+      struct readahead_file *file = *p;
+
+      if ((unsigned long) addr < (unsigned long) file->data + file->size
+	  && (unsigned long) addr + len > (unsigned long) file)
+	{
+	  *p = file->next;
+	  if (readahead_current == file)
+	    readahead_current = 0;
+	  if (readahead_target == file)
+	    readahead_target = 0;
+	}
+      else
+	p = &file->next;
+    }
+}
+
+/* Open FILENAME to read it ahead by readahead_step, allocating the
+   memory for the data in the arena.  Return false if there is nothing
+   to read.  */
+int
+readahead_open (char *filename)
+{
+  struct readahead_file *file;
+  int saved_no_decompression = no_decompression;
+  int ret, len;
+
+  readahead_close ();
+
+  /* Read the data as is, since a compressed file is inflated by
+     grub_read anyway.  */
+  no_decompression = 1;
+  ret = grub_open (filename);
+  no_decompression = saved_no_decompression;
+  if (! ret)
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  /* Continue to read the file if it has been read partially.  */
+  file = readahead_current;
+  readahead_current = 0;
+  if (! file)
+    {
+      len = readahead_name_len (readahead_name);
+      file = extmem_alloc (sizeof (*file) + len + 1 + filemax);
+      if (! file)
+	{
+	  grub_close ();
+	  return 0;
+	}
+
+      if (! readahead_files)
+	readahead_generation = extmem_generation;
+      
+      file->drive = current_drive;
+      file->partition = current_partition;
+      file->size = filemax;
+      file->len = 0;
+      file->data = file->name + len + 1;
+      grub_memmove (file->name, readahead_name, len);
+      file->name[len] = 0;
+      file->next = readahead_files;
+      readahead_files = file;
+    }
+
+  if (file->len >= file->size)
+    {
+      grub_close ();
+      return 0;
+    }
+
+  readahead_target = file;
+  return 1;
+}
+
+/* Read LEN more bytes of the file opened by readahead_open.  Return
+   false when the file is complete or it cannot be read any more.  */
+int
+readahead_step (int len)
+{
+  struct readahead_file *file = readahead_target;
+  int ret;
+
+  if (! file)
+    return 0;
+
+  if (len > file->size - file->len)
+    len = file->size - file->len;
+
+  filepos = file->len;
+  readahead_filling = 1;
+  ret = grub_read (file->data + file->len, len);
+  readahead_filling = 0;
+
+  if (errnum || ret != len)
+    {
+      errnum = ERR_NONE;
+      readahead_close ();
+      return 0;
+    }
+
+  file->len += len;
+  if (file->len >= file->size)
+    {
+      readahead_close ();
+      return 0;
+    }
+
+  return 1;
+}
+
+/* Stop reading ahead the file opened by readahead_open.  */
+void
+readahead_close (void)
+{
+  if (readahead_target)
+    {
+      readahead_target = 0;
+      grub_close ();
+    }
+}
+
+/* Return the checksum of LEN bytes at DATA in a block cache.  */
+unsigned int
+blockcache_checksum (char *data, int len)
+{
+  unsigned int sum = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    sum = ((sum << 1) | (sum >> 31)) ^ (unsigned char) data[i];
+
+  return sum;
+}
+
+/* Load the block cache FILENAME into the arena, so that grub_open
+   reads the files recorded in it by their sectors.  If FILENAME is
+   NULL, just forget the block cache loaded.  Return false if the
+   block cache is not loaded.  */
+int
+blockcache_load (char *filename)
+{
+  struct blockcache_header *cache;
+  struct blockcache_record *record;
+  int len;
+
+  blockcache = 0;
+  if (! filename)
+    return 0;
+
+  if (! grub_open (filename))
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  len = filemax;
+  if (len < (int) sizeof (*cache) || len > BLOCKCACHE_MAXLEN
+      || ! (cache = extmem_alloc (len)))
+    {
+      grub_close ();
+      return 0;
+    }
+
+  len = grub_read ((char *) cache, len);
+  grub_close ();
+  if (errnum)
+    {
+      errnum = ERR_NONE;
+      return 0;
+    }
+
+  /* Check the structure of the block cache at once, so that it can be
+     used as it is later.  */
+  if (cache->magic != BLOCKCACHE_MAGIC
+      || cache->len > len - sizeof (*cache)
+      || cache->checksum != blockcache_checksum ((char *) (cache + 1),
+						 cache->len))
+    return 0;
+
+  for (record = (struct blockcache_record *) (cache + 1);
+       record < BLOCKCACHE_END (cache);
+       record = BLOCKCACHE_NEXT (record))
+    if (record->len < sizeof (*record)
+	|| record->len > ((char *) BLOCKCACHE_END (cache)
+			  - (char *) record)
+	|| (record->len & 3)
+	|| record->runs > ((record->len - sizeof (*record))
+			   / sizeof (struct blockcache_run))
+	|| record->runs > ((BLK_MAX_ADDR - BLK_BLKLIST_START)
+			   / BLK_BLKLIST_INC_VAL))
+      return 0;
+
+  blockcache = cache;
+  blockcache_generation = extmem_generation;
+  return 1;
+}
+
+/* The digests of the files loaded by the command "verify".  */
+#define VERIFY_MAX_FILES	32
+#define VERIFY_NAMELEN		120
+
+struct verify_entry
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  char name[VERIFY_NAMELEN];
+};
+
+static struct verify_entry verify_entries[VERIFY_MAX_FILES];
+static int verify_count;
+/* If true, the files loaded as an OS image or a module must be listed
+   in VERIFY_ENTRIES.  */
+static int verify_enabled;
+
+/* The digest of the file opened, which is computed while the file is
+   read in order.  VERIFY_POS is the number of the bytes hashed, and
+   VERIFY_SIZE is the size of the file before decompression.  */
+static struct verify_entry *verify_current;
+static struct sha256_ctx verify_ctx;
+static int verify_pos;
+static int verify_size;
+static int verify_busy;
+
+/* Return the value of the hexadecimal digit C, or -1.  */
+static int
+verify_hex (int c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  c = grub_tolower (c);
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  return -1;
+}
+
+/* Return the name in NAME, without the device.  */
+static char *
+verify_skip_device (char *name)
+{
+  if (*name == '(')
+    {
+      while (*name && *name != ')')
+	name++;
+      if (*name)
+	name++;
+    }
+
+  return name;
+}
+
+/* Load the digests of the files from FILENAME, in the format of the
+   program sha256sum, that is, a digest in hexadecimal and the name of
+   the file on each line.  From now on, the files loaded as an OS image
+   or a module must be listed there, and have the same digests.  Even
+   if FILENAME cannot be read, the check is enabled, so that no file
+   is loaded unverified.  */
+int
+verify_load (char *filename)
+{
+  char line[SHA256_DIGEST_SIZE * 2 + VERIFY_NAMELEN + 4];
+  int len, eof = 0;
+
+  verify_enabled = 1;
+  verify_count = 0;
+  verify_current = 0;
+
+  if (! grub_open (filename))
+    return 0;
+
+  while (! eof && ! errnum)
+    {
+      struct verify_entry *entry = verify_entries + verify_count;
+      char *name;
+      char c;
+      int i;
+
+      for (len = 0; ; )
+	{
+	  if (! grub_read (&c, 1))
+	    {
+	      eof = 1;
+	      break;
+	    }
+
+	  if (c == '\n')
+	    break;
+
+	  if (c != '\r' && len < (int) sizeof (line) - 1)
+	    line[len++] = c;
+	}
+
+      line[len] = 0;
+      if (! len || line[0] == '#')
+	continue;
+
+      for (i = 0; i < SHA256_DIGEST_SIZE * 2; i++)
+	if (verify_hex (line[i]) < 0)
+	  break;
+
+      name = line + i;
+      if (i != SHA256_DIGEST_SIZE * 2 || ! grub_isspace (*name))
+	{
+	  errnum = ERR_BAD_ARGUMENT;
+	  break;
+	}
+
+      /* A binary file is marked with an asterisk.  */
+      while (grub_isspace (*name))
+	name++;
+      if (*name == '*')
+	name++;
+
+      name = verify_skip_device (name);
+      if (*name != '/' || grub_strlen (name) >= VERIFY_NAMELEN)
+	{
+	  errnum = ERR_BAD_FILENAME;
+	  break;
+	}
+
+      if (verify_count == VERIFY_MAX_FILES)
+	{
+	  errnum = ERR_WONT_FIT;
+	  break;
+	}
+
+      for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+	entry->digest[i] = ((verify_hex (line[i * 2]) << 4)
+			    | verify_hex (line[i * 2 + 1]));
+      grub_strcpy (entry->name, name);
+      verify_count++;
+    }
+
+  grub_close ();
+
+  /* Don't use a part of the digests.  */
+  if (errnum)
+    verify_count = 0;
+
+  return ! errnum;
+}
+
+/* Start computing the digest of the file NAME, which has just been
+   opened, if it is listed.  */
+static void
+verify_lookup (char *name)
+{
+  int len = readahead_name_len (name);
+  int i;
+
+  verify_current = 0;
+  if (! verify_enabled)
+    return;
+
+  for (i = 0; i < verify_count; i++)
+    if (! grub_memcmp (verify_entries[i].name, name, len)
+	&& ! verify_entries[i].name[len])
+      {
+	verify_current = verify_entries + i;
+	sha256_init (&verify_ctx);
+	verify_pos = 0;
+	verify_size = filemax;
+	break;
+      }
+}
+
+/* Read LEN bytes from the file opened into BUF, and add the data to
+   the digest.  Only the data following that hashed so far is added,
+   so that the file is hashed in order, without reading it again.  */
+static int
+verify_read (char *buf, int len)
+{
+  int pos = filepos;
+  int ret;
+
+  verify_busy = 1;
+  ret = grub_read (buf, len);
+  verify_busy = 0;
+
+  if (! errnum && pos <= verify_pos && pos + ret > verify_pos)
+    {
+      sha256_update (&verify_ctx, buf + verify_pos - pos,
+		     pos + ret - verify_pos);
+      verify_pos = pos + ret;
+    }
+
+  return ret;
+}
+
+/* Check the digest of the file opened, which has been loaded as an OS
+   image or a module.  The part of the file which has not been read in
+   order is read here.  Return true if the file may be booted.  */
+int
+verify_file (void)
+{
+  unsigned char digest[SHA256_DIGEST_SIZE];
+  char buf[SECTOR_SIZE];
+  int saved_filepos, saved_filemax;
+#ifndef NO_DECOMPRESSION
+  int saved_compressed_file;
+#endif
+  int i;
+
+  if (! verify_enabled)
+    return 1;
+
+  if (! verify_current)
+    {
+      errnum = ERR_NO_DIGEST;
+      return 0;
+    }
+
+  /* Read the rest of the file as it is on the disk.  */
+  saved_filepos = filepos;
+  saved_filemax = filemax;
+#ifndef NO_DECOMPRESSION
+  saved_compressed_file = compressed_file;
+  compressed_file = 0;
+#endif
+  filepos = verify_pos;
+  filemax = verify_size;
+  while (verify_pos < verify_size && ! errnum)
+    {
+      int len = verify_size - verify_pos;
+
+      if (len > SECTOR_SIZE)
+	len = SECTOR_SIZE;
+
+      if (verify_read (buf, len) != len && ! errnum)
+	errnum = ERR_FILELENGTH;
+    }
+#ifndef NO_DECOMPRESSION
+  compressed_file = saved_compressed_file;
+#endif
+  filepos = saved_filepos;
+  filemax = saved_filemax;
+
+  if (errnum)
+    {
+      verify_current = 0;
+      return 0;
+    }
+
+  sha256_final (&verify_ctx, digest);
+  for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+    if (digest[i] != verify_current->digest[i])
+      {
+	errnum = ERR_BAD_DIGEST;
+	break;
+      }
+
+  verify_current = 0;
+  return ! errnum;
+}
+
+/* Look up the file NAME, which has just been found on the current
+   partition, in the block cache.  If it is recorded, and the sectors
+   of its first and last bytes are still the same, read the file by the
+   sectors recorded, instead of through the filesystem.  */
+static void
+blockcache_lookup (char *name)
+{
+  struct blockcache_record *record;
+  struct blockcache_run *run;
+  int first = -1, last = -1;
+  int len = readahead_name_len (name);
+  int i, list_addr;
+  char c;
+
+  auto void disk_read_first_func (int sector, int offset, int length);
+  void disk_read_first_func (int sector, int offset, int length)
+    {
+      first = sector - part_start;
+    }
+
+  auto void disk_read_last_func (int sector, int offset, int length);
+  void disk_read_last_func (int sector, int offset, int length)
+    {
+      last = sector - part_start;
+    }
+
+  /* The callers of grub_open with DISK_READ_HOOK set want the sectors
+     through the filesystem.  */
+  if (! blockcache || disk_read_hook || filemax <= 0
+      || current_drive == NETWORK_DRIVE)
+    return;
+
+  if (! arena_kept (blockcache_generation))
+    {
+      blockcache = 0;
+      return;
+    }
+
+  for (record = (struct blockcache_record *) (blockcache + 1);
+       record < BLOCKCACHE_END (blockcache);
+       record = BLOCKCACHE_NEXT (record))
+    if (record->drive == current_drive
+	&& record->partition == current_partition
+	&& record->size == filemax
+	&& ! grub_strcmp (record->fsys, fsys_table[fsys_type].name)
+	&& ! grub_memcmp (record->name, name, len) && ! record->name[len])
+      break;
+
+  if (record >= BLOCKCACHE_END (blockcache))
+    return;
+
+  /* Map the first and the last bytes without reading them.  This reads
+     only a few blocks of the metadata.  */
+  disk_read_map_only = 1;
+  disk_read_hook = disk_read_first_func;
+  filepos = 0;
+  FSYS_READ_FUNC (&c, 1);
+  disk_read_hook = disk_read_last_func;
+  filepos = filemax - 1;
+  FSYS_READ_FUNC (&c, 1);
+  disk_read_hook = 0;
+  disk_read_map_only = 0;
+  filepos = 0;
+
+  if (errnum || first != record->first || last != record->last)
+    {
+      errnum = ERR_NONE;
+      return;
+    }
+
+  /* Since the block list is put in the filesystem buffer, the
+     filesystem must be mounted again.  */
+  fsys_type = NUM_FSYS;
+  run = BLOCKCACHE_RUNS (record);
+  list_addr = BLK_BLKLIST_START;
+  for (i = 0; i < record->runs; i++)
+    {
+      BLK_BLKSTART (list_addr) = run[i].start;
+      BLK_BLKLENGTH (list_addr) = run[i].length;
+      list_addr += BLK_BLKLIST_INC_VAL;
+    }
+
+  block_file = 1;
+  BLK_CUR_FILEPOS = 0;
+  BLK_CUR_BLKLIST = BLK_BLKLIST_START;
+  BLK_CUR_BLKNUM = 0;
+}
+
+/* The BIOS timer count is reset at midnight.  */
+#define TRACE_TICKS_PER_DAY	0x1800B0
+
+/* Return the BIOS timer count, which is incremented 18.2 times per
+   second.  It is read from the BIOS data area, since currticks
+   switches to the real mode, which would take longer than a read from
+   the track buffer.  The count advances while the BIOS serves the
+   disk reads, which take most of the time.  */
+static unsigned int
+trace_ticks (void)
+{
+#ifdef GRUB_UTIL
+  return currticks ();
+#else
+  unsigned int ticks;
+
+  /* The count is at 0x46C in the BIOS data area.  */
+  asm volatile ("movl 0x46C, %0" : "=r" (ticks));
+  return ticks;
+#endif
+}
+
+/* Return true if the trace is kept in the arena.  Otherwise, forget
+   it and stop tracing.  */
+static int
+trace_kept (void)
+{
+  if (trace_ring && ! arena_kept (trace_generation))
+    trace_ring = 0;
+
+  if (! trace_ring)
+    trace_enabled = 0;
+
+  return trace_ring != 0;
+}
+
+/* Start recording the file accesses into a ring of SIZE events,
+   allocated in the arena.  The trace recorded so far is continued, if
+   its ring has the same size.  Return false if there is no room.  */
+int
+trace_on (int size)
+{
+  if (size < 16)
+    size = 16;
+
+  if (! trace_kept () || trace_ring->size != size)
+    {
+      struct trace_ring *ring = 0;
+
+      if (size < (MAXINT - sizeof (*ring)) / sizeof (struct trace_event))
+	ring = extmem_alloc (sizeof (*ring)
+			     + size * sizeof (struct trace_event));
+      if (! ring)
+	return 0;
+
+      ring->size = size;
+      trace_ring = ring;
+      trace_generation = extmem_generation;
+      trace_clear ();
+    }
+
+  trace_enabled = 1;
+  return 1;
+}
+
+/* Stop recording the file accesses.  The trace is kept.  */
+void
+trace_off (void)
+{
+  trace_enabled = 0;
+}
+
+/* Forget the events recorded so far.  */
+void
+trace_clear (void)
+{
+  int i;
+
+  if (! trace_kept ())
+    return;
+
+  trace_ring->recorded = 0;
+  for (i = 0; i < TRACE_NAMES; i++)
+    trace_ring->names[i][0] = 0;
+  trace_file = 0;
+}
+
+/* Describe the trace in HEADER.  */
+void
+trace_header (struct trace_header *header)
+{
+  header->magic = TRACE_MAGIC;
+  header->size = 0;
+  header->count = 0;
+  header->lost = 0;
+  header->files = trace_file;
+  header->names = 0;
+
+  if (! trace_kept ())
+    return;
+
+  header->size = trace_ring->size;
+  header->count = trace_ring->recorded;
+  if (header->count > header->size)
+    {
+      header->lost = header->count - header->size;
+      header->count = header->size;
+    }
+
+  header->names = trace_file < TRACE_NAMES ? trace_file : TRACE_NAMES;
+}
+
+/* Return the Nth oldest event kept in the trace.  */
+struct trace_event *
+trace_get (int n)
+{
+  unsigned int first = 0;
+
+  if (trace_ring->recorded > trace_ring->size)
+    first = trace_ring->recorded - trace_ring->size;
+
+  return trace_ring->events + (first + n) % trace_ring->size;
+}
+
+/* Return the name of the file whose serial number is FILE, or zero if
+   it has been forgotten.  */
+char *
+trace_name (unsigned int file)
+{
+  if (! trace_ring || file == 0 || file > trace_file
+      || trace_file - file >= TRACE_NAMES)
+    return 0;
+
+  return trace_ring->names[file % TRACE_NAMES];
+}
+
+/* Start EVENT of TYPE, which is recorded by trace_end when the access
+   is finished.  */
+static void
+trace_begin (struct trace_event *event, int type)
+{
+  event->type = type;
+  event->fsys = fsys_type;
+  event->hit = 0;
+  event->drive = current_drive;
+  event->file = trace_file;
+  event->sector = 0;
+  event->offset = 0;
+  event->length = 0;
+  event->sectors = trace_sectors;
+  event->ticks = trace_ticks ();
+  event->elapsed = 0;
+}
+
+/* Record EVENT, started by trace_begin, into the ring.  The fields are
+   copied one by one, since memcpy would drop the ring through
+   cache_protect.  */
+static void
+trace_end (struct trace_event *event)
+{
+  unsigned int ticks = trace_ticks ();
+  struct trace_event *p;
+
+  if (! trace_kept ())
+    return;
+
+  if (ticks < event->ticks)
+    ticks += TRACE_TICKS_PER_DAY;
+
+  p = trace_ring->events + trace_ring->recorded % trace_ring->size;
+  trace_ring->recorded++;
+  p->type = event->type;
+  p->fsys = event->fsys;
+  p->drive = event->drive;
+  p->file = event->file;
+  p->sector = event->sector;
+  p->offset = event->offset;
+  p->length = event->length;
+  p->sectors = trace_sectors - event->sectors;
+  p->hit = ! p->sectors;
+  p->ticks = event->ticks;
+  p->elapsed = ticks - event->ticks;
+}
+
+/* Open FILENAME, recording the event with the name of the file.  */
+static int
+trace_open (char *filename)
+{
+  struct trace_event event;
+  int i, ret;
+
+  trace_file++;
+  if (trace_kept ())
+    {
+      char *name = trace_ring->names[trace_file % TRACE_NAMES];
+
+      for (i = 0; (i < TRACE_NAME_LEN - 1 && filename[i]
+		   && ! isspace (filename[i])); i++)
+	name[i] = filename[i];
+      name[i] = 0;
+    }
+
+  trace_begin (&event, TRACE_OPEN);
+  trace_busy = 1;
+  ret = grub_open (filename);
+  trace_busy = 0;
+
+  event.fsys = fsys_type;
+  event.drive = current_drive;
+  event.sector = part_start;
+  event.offset = errnum;
+  event.length = ret ? filemax : 0;
+  trace_end (&event);
+  return ret;
+}
+
+/* Read LEN bytes of the current file into BUF, recording the event.  */
+static int
+trace_read (char *buf, int len)
+{
+  struct trace_event event;
+  int ret;
+
+  trace_begin (&event, TRACE_READ);
+  event.offset = filepos;
+  trace_busy = 1;
+  ret = grub_read (buf, len);
+  trace_busy = 0;
+
+  event.length = ret;
+  trace_end (&event);
+  return ret;
+}
+#endif /* ! STAGE1_5 */
+
 int
 grub_open (char *filename)
 {
+#ifndef STAGE1_5
+  if (trace_enabled && ! trace_busy)
+    return trace_open (filename);
+#endif
+
 #ifndef NO_DECOMPRESSION
   compressed_file = 0;
 #endif /* NO_DECOMPRESSION */
 
+#ifndef STAGE1_5
+  readahead_current = 0;
+  verify_current = 0;
+#endif
+
   /* if any "dir" function uses/sets filepos, it must
      set it to zero before returning if opening a file! */
   filepos = 0;
@@ -1612,6 +2750,11 @@ grub_open (char *filename)
 	  BLK_CUR_BLKLIST = BLK_BLKLIST_START;
 	  BLK_CUR_BLKNUM = 0;
 
+#ifndef STAGE1_5
+	  verify_lookup (filename);
+	  readahead_lookup (filename);
+#endif
+	  
 #ifndef NO_DECOMPRESSION
 	  return gunzip_test_header ();
 #else /* NO_DECOMPRESSION */
@@ -1631,8 +2774,14 @@ grub_open (char *filename)
   print_possibilities = 0;
 # endif
 
-  if (!errnum && (*(fsys_table[fsys_type].dir_func)) (filename))
+  if (!errnum && FSYS_DIR_FUNC (filename))
     {
+#ifndef STAGE1_5
+      blockcache_lookup (filename);
+      verify_lookup (filename);
+      readahead_lookup (filename);
+#endif
+      
 #ifndef NO_DECOMPRESSION
       return gunzip_test_header ();
 #else /* NO_DECOMPRESSION */
@@ -1664,11 +2813,43 @@ grub_read (char *buf, int len)
       return 0;
     }
 
+#ifndef STAGE1_5
+  if (trace_enabled && ! trace_busy
+      && ! (disk_read_hook && disk_read_map_only))
+    return trace_read (buf, len);
+
+  /* The caches in the arena must not overwrite the data.  A file read
+     ahead is in the arena itself.  */
+  if (! (disk_read_hook && disk_read_map_only) && ! readahead_filling)
+    extmem_protect (buf, len);
+#endif
+
 #ifndef NO_DECOMPRESSION
   if (compressed_file)
     return gunzip_read (buf, len);
 #endif /* NO_DECOMPRESSION */
 
+#ifndef STAGE1_5
+  /* Compute the digest of the data read as it is on the disk.  */
+  if (verify_current && ! verify_busy && ! readahead_filling
+      && ! (disk_read_hook && disk_read_map_only))
+    return verify_read (buf, len);
+  
+  /* Take the data read ahead, if any, and read the rest as usual.  */
+  if (readahead_current && ! disk_read_hook)
+    {
+      int ret = readahead_read (buf, len);
+
+      if (ret)
+	{
+	  if (ret < len && ! errnum)
+	    ret += grub_read (buf + ret, len - ret);
+
+	  return errnum ? 0 : ret;
+	}
+    }
+#endif
+
 #ifndef NO_BLOCK_FILES
   if (block_file)
     {
@@ -1736,7 +2917,7 @@ grub_read (char *buf, int len)
       return 0;
     }
 
-  return (*(fsys_table[fsys_type].read_func)) (buf, len);
+  return FSYS_READ_FUNC (buf, len);
 }
 
 #ifndef STAGE1_5
@@ -1773,7 +2954,7 @@ dir (char *dirname)
   /* set "dir" function to list completions */
   print_possibilities = 1;
 
-  return (*(fsys_table[fsys_type].dir_func)) (dirname);
+  return FSYS_DIR_FUNC (dirname);
 }
 #endif /* STAGE1_5 */
 
@@ -1785,6 +2966,8 @@ grub_close (void)
     return;
 #endif /* NO_BLOCK_FILES */
   
+#ifndef STAGE1_5
   if (fsys_table[fsys_type].close_func != 0)
     (*(fsys_table[fsys_type].close_func)) ();
+#endif /* ! STAGE1_5 */
 }
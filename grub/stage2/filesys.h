@@ -131,6 +131,55 @@ int iso9660_dir (char *dirname);
    + FSYS_TFTP_NUM + FSYS_ISO9660_NUM + FSYS_UFS2_NUM)
 #endif
 
+/* Stage 1.5 has only one filesystem, so call its functions directly
+   instead of through FSYS_TABLE, which is not even compiled in.  */
+#ifdef STAGE1_5
+# if defined(FSYS_FFS)
+#  define FSYS_MOUNT_FUNC	ffs_mount
+#  define FSYS_READ_FUNC	ffs_read
+#  define FSYS_DIR_FUNC		ffs_dir
+# elif defined(FSYS_UFS2)
+#  define FSYS_MOUNT_FUNC	ufs2_mount
+#  define FSYS_READ_FUNC	ufs2_read
+#  define FSYS_DIR_FUNC		ufs2_dir
+# elif defined(FSYS_FAT)
+#  define FSYS_MOUNT_FUNC	fat_mount
+#  define FSYS_READ_FUNC	fat_read
+#  define FSYS_DIR_FUNC		fat_dir
+# elif defined(FSYS_EXT2FS)
+#  define FSYS_MOUNT_FUNC	ext2fs_mount
+#  define FSYS_READ_FUNC	ext2fs_read
+#  define FSYS_DIR_FUNC		ext2fs_dir
+# elif defined(FSYS_MINIX)
+#  define FSYS_MOUNT_FUNC	minix_mount
+#  define FSYS_READ_FUNC	minix_read
+#  define FSYS_DIR_FUNC		minix_dir
+# elif defined(FSYS_REISERFS)
+#  define FSYS_MOUNT_FUNC	reiserfs_mount
+#  define FSYS_READ_FUNC	reiserfs_read
+#  define FSYS_DIR_FUNC		reiserfs_dir
+# elif defined(FSYS_VSTAFS)
+#  define FSYS_MOUNT_FUNC	vstafs_mount
+#  define FSYS_READ_FUNC	vstafs_read
+#  define FSYS_DIR_FUNC		vstafs_dir
+# elif defined(FSYS_JFS)
+#  define FSYS_MOUNT_FUNC	jfs_mount
+#  define FSYS_READ_FUNC	jfs_read
+#  define FSYS_DIR_FUNC		jfs_dir
+# elif defined(FSYS_XFS)
+#  define FSYS_MOUNT_FUNC	xfs_mount
+#  define FSYS_READ_FUNC	xfs_read
+#  define FSYS_DIR_FUNC		xfs_dir
+# elif defined(FSYS_ISO9660)
+#  define FSYS_MOUNT_FUNC	iso9660_mount
+#  define FSYS_READ_FUNC	iso9660_read
+#  define FSYS_DIR_FUNC		iso9660_dir
+# endif
+#else /* ! STAGE1_5 */
+# define FSYS_READ_FUNC		(*(fsys_table[fsys_type].read_func))
+# define FSYS_DIR_FUNC		(*(fsys_table[fsys_type].dir_func))
+#endif /* ! STAGE1_5 */
+
 /* defines for the block filesystem info area */
 #ifndef NO_BLOCK_FILES
 #define BLK_CUR_FILEPOS      (*((int*)FSYS_BUF))
@@ -162,4 +211,6 @@ extern int print_possibilities;
 #endif
 
 extern int fsmax;
+#ifndef STAGE1_5
 extern struct fsys_entry fsys_table[NUM_FSYS + 1];
+#endif
@@ -51,9 +51,11 @@ struct iso_inode_info {
 #define INODE		\
     ((struct iso_inode_info *)(FSYS_BUF+sizeof(struct iso_sb_info)))
 #define PRIMDESC        ((struct iso_primary_descriptor *)(FSYS_BUF + 2048))
-#define DIRREC          ((struct iso_directory_record *)(FSYS_BUF + 4096))
-#define RRCONT_BUF      ((unsigned char *)(FSYS_BUF + 6144))
-#define NAME_BUF        ((unsigned char *)(FSYS_BUF + 8192))
+#define RRCONT_BUF      ((unsigned char *)(FSYS_BUF + 4096))
+#define NAME_BUF        ((unsigned char *)(FSYS_BUF + 6144))
+#define DIRREC          ((struct iso_directory_record *)(FSYS_BUF + 8192))
+/* The number of the directory sectors read at once into DIRREC.  */
+#define DIRREC_SECTORS	((FSYS_BUFLEN - 8192) >> ISO_SECTOR_BITS)
 
 
 static inline unsigned long
@@ -81,12 +83,12 @@ iso9660_devread (int sector, int byte_offset, int byte_len, char *buf)
   if (byte_len <= 0)
     return 1;
 
-  sector += (byte_offset >> sector_size_lg2);
-  byte_offset &= (buf_geom.sector_size - 1);
   asm volatile ("shl%L0 %1,%0"
 		: "=r"(sector)
 		: "Ic"((int8_t)(ISO_SECTOR_BITS - sector_size_lg2)),
 		"0"(sector));
+  sector += (byte_offset >> sector_size_lg2);
+  byte_offset &= (buf_geom.sector_size - 1);
 
 #if !defined(STAGE1_5)
   if (disk_read_hook && debug)
@@ -132,6 +134,28 @@ iso9660_mount (void)
   return 0;
 }
 
+/* Return the first directory record at or after PTR in DIRREC, which
+   holds the directory sectors up to END. A record never crosses a
+   sector boundary, and a zero length marks the padding up to the next
+   sector. Return NULL if there is no more record.  */
+static struct iso_directory_record *
+dir_record_at (char *ptr, char *end)
+{
+  while (ptr < end)
+    {
+      int offset = (ptr - (char *) DIRREC) & (ISO_SECTOR_SIZE - 1);
+      int length = ((struct iso_directory_record *) ptr)->length.l;
+
+      if (length > 0 && offset + length <= ISO_SECTOR_SIZE)
+	return (struct iso_directory_record *) ptr;
+
+      /* Skip to the next sector.  */
+      ptr += ISO_SECTOR_SIZE - offset;
+    }
+
+  return NULL;
+}
+
 int
 iso9660_dir (char *dirname)
 {
@@ -144,6 +168,8 @@ iso9660_dir (char *dirname)
   unsigned char file_type;
   unsigned int rr_len;
   unsigned char rr_flag;
+  int nsect;
+  char *end;
 
   idr = &PRIMDESC->root_directory_record;
   INODE->file_start = 0;
@@ -164,16 +190,23 @@ iso9660_dir (char *dirname)
 
       while (size > 0)
 	{
-	  if (!iso9660_devread(extent, 0, ISO_SECTOR_SIZE, (char *)DIRREC))
+	  /* Read as many sectors of the extent as DIRREC can hold.  */
+	  nsect = (size + ISO_SECTOR_SIZE - 1) >> ISO_SECTOR_BITS;
+	  if (nsect > DIRREC_SECTORS)
+	    nsect = DIRREC_SECTORS;
+
+	  if (!iso9660_devread(extent, 0, nsect << ISO_SECTOR_BITS,
+			       (char *)DIRREC))
 	    {
 	      errnum = ERR_FSYS_CORRUPT;
 	      return 0;
 	    }
-	  extent++;
+	  extent += nsect;
+	  end = (char *)DIRREC + (nsect << ISO_SECTOR_BITS);
 
-	  idr = (struct iso_directory_record *)DIRREC;
-	  for (; idr->length.l > 0;
-	       idr = (struct iso_directory_record *)((char *)idr + idr->length.l) )
+	  for (idr = dir_record_at ((char *)DIRREC, end);
+	       idr != NULL;
+	       idr = dir_record_at ((char *)idr + idr->length.l, end))
 	    {
 	      const char *name = idr->name;
 	      unsigned int name_len = idr->name_len.l;
@@ -387,7 +420,7 @@ iso9660_dir (char *dirname)
 		}
 	    } /* for */
 
-	  size -= ISO_SECTOR_SIZE;
+	  size -= nsect << ISO_SECTOR_BITS;
 	} /* size>0 */
 
       if (dirname[pathlen] == '/' || print_possibilities >= 0)
@@ -407,36 +440,26 @@ iso9660_dir (char *dirname)
 int
 iso9660_read (char *buf, int len)
 {
-  int sector, blkoffset, size, ret;
+  int ret;
 
   if (INODE->file_start == 0)
     return 0;
 
-  ret = 0;
-  blkoffset = filepos & (ISO_SECTOR_SIZE - 1);
-  sector = filepos >> ISO_SECTOR_BITS;
-  while (len > 0)
-    {
-      size = ISO_SECTOR_SIZE - blkoffset;
-      if (size > len)
-        size = len;
-
-      disk_read_func = disk_read_hook;
-
-      if (!iso9660_devread(INODE->file_start + sector, blkoffset, size, buf))
-	return 0;
+  if (len <= 0)
+    return 0;
 
-      disk_read_func = NULL;
+  /* The data of a file is contiguous, so read the whole span at once.
+     RAWREAD then reads as many sectors per BIOS call as the track
+     buffer can hold, instead of one call per ISO sector.  */
+  disk_read_func = disk_read_hook;
+  ret = iso9660_devread (INODE->file_start, filepos, len, buf);
+  disk_read_func = NULL;
 
-      len -= size;
-      buf += size;
-      ret += size;
-      filepos += size;
-      sector++;
-      blkoffset = 0;
-    }
+  if (!ret)
+    return 0;
 
-  return ret;
+  filepos += len;
+  return len;
 }
 
 #endif /* FSYS_ISO9660 */
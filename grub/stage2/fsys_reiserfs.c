@@ -295,6 +295,16 @@ struct reiserfs_de_head
 #define FSYSREISER_MIN_BLOCKSIZE SECTOR_SIZE
 #define FSYSREISER_MAX_BLOCKSIZE FSYSREISER_CACHE_SIZE / 3
 
+/* The maximum number of tree nodes in the node cache in the arena */
+#ifndef FSYSREISER_NODE_CACHE_SLOTS
+# define FSYSREISER_NODE_CACHE_SLOTS 256
+#endif
+
+/* The number of bits of the journal hash in the arena */
+#ifndef FSYSREISER_JOURNAL_HASH_BITS
+# define FSYSREISER_JOURNAL_HASH_BITS 14
+#endif
+
 /* Info about currently opened file */
 struct fsys_reiser_fileinfo
 {
@@ -333,6 +343,15 @@ struct fsys_reiser_info
   __u16 cached_slots;
   /* The number of valid transactions in journal */
   __u16 journal_transactions;
+  /* The number of transactions held in the journal hash */
+  __u16 journal_cached;
+  /* The descriptor block of the first transaction that isn't in the
+     journal hash (relative to journal_block) */
+  __u32 journal_uncached_desc;
+  /* The keys of the journal hash, followed by its values */
+  __u32 *journal_hash_keys;
+  /* The number of bits of the journal hash */
+  __u16 journal_hash_bits;
   
   unsigned int blocks[MAX_HEIGHT];
   unsigned int next_key_nr[MAX_HEIGHT];
@@ -355,15 +374,71 @@ struct fsys_reiser_info
 #define INFO \
     ((struct fsys_reiser_info *) ((int) FSYS_BUF + FSYSREISER_CACHE_SIZE))
 /* 
- * The journal cache.  For each transaction it contains the number of
- * blocks followed by the real block numbers of this transaction.  
+ * The journal cache.  It is an open addressing hash table, that maps
+ * the real block numbers to the journal block (relative to
+ * journal_block) holding the newest copy of the block.  It is allocated
+ * in the arena in the extended memory, or follows the fsys_reiser_info
+ * block if there is no arena, as in stage 1.5.  The keys are
+ * JOURNAL_HASH_SIZE block numbers, with 0xffffffff for an empty slot,
+ * followed by the same number of 16-bit journal blocks.
  *
- * If the block numbers of some transaction won't fit in this space,
- * this list is stopped with a 0xffffffff marker and the remaining
- * uncommitted transactions aren't cached.  
+ * If the blocks of some transaction won't fit in the table, the
+ * remaining uncommitted transactions aren't cached, and they are read
+ * from the disk on demand.
+ */
+/* The number of bits of the hash in FSYS_BUF.  */
+#define JOURNAL_HASH_BUF_BITS	10
+/* The number of slots in the hash (a power of 2).  */
+#define JOURNAL_HASH_BITS	(INFO->journal_hash_bits)
+#define JOURNAL_HASH_SIZE	(1 << JOURNAL_HASH_BITS)
+/* Keep the table at most three quarters full, so probing is short.  */
+#define JOURNAL_HASH_MAX	(JOURNAL_HASH_SIZE / 4 * 3)
+#define JOURNAL_HASH_KEYS	(INFO->journal_hash_keys)
+#define JOURNAL_HASH_VALS	((__u16 *) (JOURNAL_HASH_KEYS + JOURNAL_HASH_SIZE))
+#define JOURNAL_HASH_EMPTY	0xffffffff
+
+#ifndef STAGE1_5
+/* The journal hash in the arena, valid as long as extmem_generation
+ * is JOURNAL_HASH_GENERATION.
+ */
+static __u32 *journal_hash;
+static unsigned long journal_hash_generation;
+
+/* The node cache in the arena in the extended memory.  It holds the
+ * recently used tree nodes of the filesystem on DRIVE and PARTITION,
+ * so that the nodes that drop out of the path in FSYS_BUF needn't be
+ * read again.  The least recently used node is replaced, when the
+ * cache is full.  The nodes follow the header at NODE_CACHE_DATA.
  */
-#define JOURNAL_START    ((__u32 *) (INFO + 1))
-#define JOURNAL_END      ((__u32 *) (FSYS_BUF + FSYS_BUFLEN))
+struct fsys_reiser_node_cache
+{
+  /* The filesystem the nodes belong to */
+  __u32 drive;
+  __u32 partition;
+  __u32 blocksize;
+  /* The number of slots for this blocksize */
+  __u32 slots;
+  /* Incremented on each access, to find the least recently used node */
+  __u32 clock;
+  /* The value of disk_write_count, when the nodes were read */
+  __u32 write_count;
+  /* The block numbers of the nodes, zero for an empty slot */
+  __u32 blocks[FSYSREISER_NODE_CACHE_SLOTS];
+  /* The clock value of the last access to each node */
+  __u32 used[FSYSREISER_NODE_CACHE_SLOTS];
+};
+
+/* The node cache and the size of its data, valid as long as
+ * extmem_generation is NODE_CACHE_GENERATION.
+ */
+static struct fsys_reiser_node_cache *node_cache;
+static int node_cache_size;
+static unsigned long node_cache_generation;
+
+#define NODE_CACHE node_cache
+#define NODE_CACHE_DATA(i) \
+    ((char *) (node_cache + 1) + ((i) << INFO->fullblocksize_shift))
+#endif /* ! STAGE1_5 */
 
 
 static __inline__ unsigned long
@@ -388,6 +463,20 @@ journal_read (int block, int len, char *buffer)
 		  0, len, buffer);
 }
 
+/* Return the slot of BLOCKNR in the journal hash, or the empty slot
+ * where it would be inserted.
+ */
+static int
+journal_hash_slot (__u32 blockNr)
+{
+  int slot = (__u32) (blockNr * 2654435761UL) >> (32 - JOURNAL_HASH_BITS);
+
+  while (JOURNAL_HASH_KEYS[slot] != blockNr
+	 && JOURNAL_HASH_KEYS[slot] != JOURNAL_HASH_EMPTY)
+    slot = (slot + 1) & (JOURNAL_HASH_SIZE - 1);
+  return slot;
+}
+
 /* Read a block from ReiserFS file system, taking the journal into
  * account.  If the block nr is in the journal, the block from the
  * journal taken.  
@@ -395,54 +484,67 @@ journal_read (int block, int len, char *buffer)
 static int
 block_read (int blockNr, int start, int len, char *buffer)
 {
-  int transactions = INFO->journal_transactions;
-  int desc_block = INFO->journal_first_desc;
+  int transactions = INFO->journal_transactions - INFO->journal_cached;
+  int desc_block = INFO->journal_uncached_desc;
   int journal_mask = INFO->journal_block_count - 1;
   int translatedNr = blockNr;
-  __u32 *journal_table = JOURNAL_START;
+
+#ifndef STAGE1_5
+  if (JOURNAL_HASH_KEYS == journal_hash
+      && journal_hash_generation != extmem_generation
+      && INFO->journal_cached > 0)
+    {
+      /* The arena was given up, so the hash is lost.  Read all the
+	 transactions from the disk.  */
+      INFO->journal_cached = 0;
+      INFO->journal_uncached_desc = INFO->journal_first_desc;
+      transactions = INFO->journal_transactions;
+      desc_block = INFO->journal_first_desc;
+    }
+#endif /* ! STAGE1_5 */
+  
+  if (INFO->journal_cached > 0)
+    {
+      /* The hash holds the newest copy among the cached transactions.  */
+      int slot = journal_hash_slot (blockNr);
+      
+      if (JOURNAL_HASH_KEYS[slot] == blockNr)
+	{
+	  translatedNr = INFO->journal_block + JOURNAL_HASH_VALS[slot];
+#ifdef REISERDEBUG
+	  printf ("block_read: block %d is mapped to journal block %d.\n", 
+		  blockNr, translatedNr - INFO->journal_block);
+#endif
+	}
+    }
+
+  /* The transactions that didn't fit in the hash are newer, so they
+   * override the cached ones.
+   */
   while (transactions-- > 0) 
     {
       int i = 0;
       int j_len;
-      if (*journal_table != 0xffffffff)
-	{
-	  /* Search for the blockNr in cached journal */
-	  j_len = *journal_table++;
-	  while (i++ < j_len)
-	    {
-	      if (*journal_table++ == blockNr)
-		{
-		  journal_table += j_len - i;
-		  goto found;
-		}
-	    }
-	}
-      else
-	{
-	  /* This is the end of cached journal marker.  The remaining
-	   * transactions are still on disk.
-	   */
-	  struct reiserfs_journal_desc   desc;
-	  struct reiserfs_journal_commit commit;
+      struct reiserfs_journal_desc   desc;
+      struct reiserfs_journal_commit commit;
 
-	  if (! journal_read (desc_block, sizeof (desc), (char *) &desc))
-	    return 0;
+      if (! journal_read (desc_block, sizeof (desc), (char *) &desc))
+	return 0;
 
-	  j_len = desc.j_len;
-	  while (i < j_len && i < JOURNAL_TRANS_HALF)
-	    if (desc.j_realblock[i++] == blockNr)
+      j_len = desc.j_len;
+      while (i < j_len && i < JOURNAL_TRANS_HALF)
+	if (desc.j_realblock[i++] == blockNr)
+	  goto found;
+      
+      if (j_len >= JOURNAL_TRANS_HALF)
+	{
+	  int commit_block = (desc_block + 1 + j_len) & journal_mask;
+	  if (! journal_read (commit_block, 
+			      sizeof (commit), (char *) &commit))
+	    return 0;
+	  while (i < j_len)
+	    if (commit.j_realblock[i++ - JOURNAL_TRANS_HALF] == blockNr)
 	      goto found;
-	  
-	  if (j_len >= JOURNAL_TRANS_HALF)
-	    {
-	      int commit_block = (desc_block + 1 + j_len) & journal_mask;
-	      if (! journal_read (commit_block, 
-				  sizeof (commit), (char *) &commit))
-		return 0;
-	      while (i < j_len)
-		if (commit.j_realblock[i++ - JOURNAL_TRANS_HALF] == blockNr)
-		  goto found;
-	    }
 	}
       goto not_found;
       
@@ -461,9 +563,138 @@ block_read (int blockNr, int start, int len, char *buffer)
   return devread (translatedNr << INFO->blocksize_shift, start, len, buffer);
 }
 
+#ifndef STAGE1_5
+/* Use the journal hash in the arena, allocating it if needed.  Return
+ * zero if there is no room for it.
+ */
+static int
+journal_hash_init (void)
+{
+  if (! journal_hash || journal_hash_generation != extmem_generation)
+    {
+      journal_hash = extmem_alloc ((sizeof (__u32) + sizeof (__u16))
+				   << FSYSREISER_JOURNAL_HASH_BITS);
+      if (! journal_hash)
+	return 0;
+      
+      journal_hash_generation = extmem_generation;
+    }
+
+  INFO->journal_hash_keys = journal_hash;
+  INFO->journal_hash_bits = FSYSREISER_JOURNAL_HASH_BITS;
+  return 1;
+}
+
+/* Return nonzero if the node cache may be used.  */
+static int
+node_cache_usable (void)
+{
+  return node_cache && node_cache_generation == extmem_generation;
+}
+
+/* Take over the node cache for the mounted filesystem, allocating it
+ * in the arena if needed.  The nodes are kept, if they belong to the
+ * same filesystem.
+ */
+static void
+node_cache_init (void)
+{
+  int slots;
+  
+  if (! node_cache_usable ())
+    {
+      /* Get as many slots of the largest size as possible.  */
+      node_cache = 0;
+      for (slots = FSYSREISER_NODE_CACHE_SLOTS; slots >= 8; slots >>= 1)
+	{
+	  node_cache_size = slots * FSYSREISER_MAX_BLOCKSIZE;
+	  node_cache = extmem_alloc (sizeof (struct fsys_reiser_node_cache)
+				     + node_cache_size);
+	  if (node_cache)
+	    break;
+	}
+      
+      if (! node_cache)
+	return;
+      
+      node_cache_generation = extmem_generation;
+    }
+  else if (NODE_CACHE->drive == current_drive
+	   && NODE_CACHE->partition == current_partition
+	   && NODE_CACHE->blocksize == INFO->blocksize)
+    return;
+
+  slots = node_cache_size >> INFO->fullblocksize_shift;
+  if (slots > FSYSREISER_NODE_CACHE_SLOTS)
+    slots = FSYSREISER_NODE_CACHE_SLOTS;
+  
+  NODE_CACHE->drive = current_drive;
+  NODE_CACHE->partition = current_partition;
+  NODE_CACHE->blocksize = INFO->blocksize;
+  NODE_CACHE->slots = slots;
+  NODE_CACHE->clock = 0;
+  NODE_CACHE->write_count = disk_write_count;
+  memset (NODE_CACHE->blocks, 0, sizeof (NODE_CACHE->blocks));
+}
+#endif /* ! STAGE1_5 */
+
+/* Read the tree node BLOCKNR into CACHE.  It is taken from the node
+ * cache if possible.
+ */
+static int
+node_read (unsigned int blockNr, char *cache)
+{
+#ifndef STAGE1_5
+  int i, lru = 0;
+  
+  if (node_cache_usable ())
+    {
+      __u32 clock;
+      
+      if (NODE_CACHE->write_count != disk_write_count)
+	{
+	  /* GRUB wrote to a disk, so the nodes may be stale.  */
+	  NODE_CACHE->write_count = disk_write_count;
+	  memset (NODE_CACHE->blocks, 0, sizeof (NODE_CACHE->blocks));
+	}
+      
+      clock = ++NODE_CACHE->clock;
+      for (i = 0; i < NODE_CACHE->slots; i++)
+	{
+	  if (NODE_CACHE->blocks[i] == blockNr)
+	    {
+	      NODE_CACHE->used[i] = clock;
+	      memcpy (cache, NODE_CACHE_DATA (i), INFO->blocksize);
+	      return 1;
+	    }
+	  
+	  if (NODE_CACHE->blocks[i] == 0)
+	    {
+	      /* The rest of the slots are empty.  */
+	      lru = i;
+	      break;
+	    }
+	  
+	  if (NODE_CACHE->used[i] < NODE_CACHE->used[lru])
+	    lru = i;
+	}
+
+      if (! block_read (blockNr, 0, INFO->blocksize, cache))
+	return 0;
+      
+      NODE_CACHE->blocks[lru] = blockNr;
+      NODE_CACHE->used[lru] = clock;
+      memcpy (NODE_CACHE_DATA (lru), cache, INFO->blocksize);
+      return 1;
+    }
+#endif /* ! STAGE1_5 */
+  
+  return block_read (blockNr, 0, INFO->blocksize, cache);
+}
+
 /* Init the journal data structure.  We try to cache as much as
- * possible in the JOURNAL_START-JOURNAL_END space, but if it is full
- * we can still read the rest from the disk on demand.
+ * possible in the journal hash, but if it is full we can still read
+ * the rest from the disk on demand.
  *
  * The first number of valid transactions and the descriptor block of the
  * first valid transaction are held in INFO.  The transactions are all 
@@ -479,7 +710,9 @@ journal_init (void)
   struct reiserfs_journal_header header;
   struct reiserfs_journal_desc   desc;
   struct reiserfs_journal_commit commit;
-  __u32 *journal_table = JOURNAL_START;
+  int hash_entries = 0;
+  /* The journal blocks must fit in the 16-bit values of the hash.  */
+  int hash_full = block_count > 0x10000;
 
   journal_read (block_count, sizeof (header), (char *) &header);
   desc_block = header.j_first_unflushed_offset;
@@ -487,6 +720,9 @@ journal_init (void)
     return 0;
 
   INFO->journal_first_desc = desc_block;
+  INFO->journal_uncached_desc = desc_block;
+  INFO->journal_cached = 0;
+  memset (JOURNAL_HASH_KEYS, 0xff, JOURNAL_HASH_SIZE * sizeof (__u32));
   next_trans_id = header.j_last_flush_trans_id + 1;
 
 #ifdef REISERDEBUG
@@ -516,43 +752,41 @@ journal_init (void)
 #endif
 
       next_trans_id++;
-      if (journal_table < JOURNAL_END)
+      if (! hash_full && hash_entries + desc.j_len > JOURNAL_HASH_MAX)
+	/* The hash is full; the remaining transactions are read from
+	   the disk.  */
+	hash_full = 1;
+      
+      if (! hash_full)
 	{
-	  if ((journal_table + 1 + desc.j_len) >= JOURNAL_END)
-	    {
-	      /* The table is almost full; mark the end of the cached
-	       * journal.*/
-	      *journal_table = 0xffffffff;
-	      journal_table = JOURNAL_END;
-	    }
-	  else
+	  int i;
+	  /* Add the realblock numbers to the hash.  A block of a later
+	   * transaction replaces the copy of an earlier one.  The journal
+	   * block of the copy can easily be computed from the descriptor.
+	   */
+	  for (i = 0; i < desc.j_len; i++)
 	    {
-	      int i;
-	      /* Cache the length and the realblock numbers in the table.
-	       * The block number of descriptor can easily be computed.
-	       * and need not to be stored here.
-	       */
-	      *journal_table++ = desc.j_len;
-	      for (i = 0; i < desc.j_len && i < JOURNAL_TRANS_HALF; i++)
+	      __u32 blockNr = (i < JOURNAL_TRANS_HALF
+			       ? desc.j_realblock[i]
+			       : commit.j_realblock[i - JOURNAL_TRANS_HALF]);
+	      int slot = journal_hash_slot (blockNr);
+	      
+	      if (JOURNAL_HASH_KEYS[slot] == JOURNAL_HASH_EMPTY)
 		{
-		  *journal_table++ = desc.j_realblock[i];
-#ifdef REISERDEBUG
-		  printf ("block %d is in journal %d.\n", 
-			  desc.j_realblock[i], desc_block);
-#endif
+		  JOURNAL_HASH_KEYS[slot] = blockNr;
+		  hash_entries++;
 		}
-	      for (     ; i < desc.j_len; i++)
-		{
-		  *journal_table++ = commit.j_realblock[i-JOURNAL_TRANS_HALF];
+	      JOURNAL_HASH_VALS[slot] = (desc_block + 1 + i) & (block_count - 1);
 #ifdef REISERDEBUG
-		  printf ("block %d is in journal %d.\n", 
-			  commit.j_realblock[i-JOURNAL_TRANS_HALF], 
-			  desc_block);
+	      printf ("block %d is in journal %d.\n", blockNr, desc_block);
 #endif
-		}
 	    }
+	  INFO->journal_cached++;
 	}
+      
       desc_block = (commit_block + 1) & (block_count - 1);
+      if (! hash_full)
+	INFO->journal_uncached_desc = desc_block;
     }
 #ifdef REISERDEBUG
   printf ("Transaction %d/%d at %d isn't valid.\n", 
@@ -631,10 +865,18 @@ reiserfs_mount (void)
    * journal_transactions, so we don't access the journal at all.  
    */
   INFO->journal_transactions = 0;
+  INFO->journal_cached = 0;
   if (super.s_journal_block != 0 && super.s_journal_dev == 0)
     {
       INFO->journal_block = super.s_journal_block;
       INFO->journal_block_count = super.s_journal_size;
+#ifndef STAGE1_5
+      if (! journal_hash_init ())
+#endif
+	{
+	  INFO->journal_hash_keys = (__u32 *) (INFO + 1);
+	  INFO->journal_hash_bits = JOURNAL_HASH_BUF_BITS;
+	}
       if (is_power_of_two (INFO->journal_block_count))
 	journal_init ();
 
@@ -643,7 +885,11 @@ reiserfs_mount (void)
 		  0, sizeof (struct reiserfs_super_block), (char *) &super);
     }
 
-  if (! block_read (super.s_root_block, 0, INFO->blocksize, (char*) ROOT))
+#ifndef STAGE1_5
+  node_cache_init ();
+#endif
+  
+  if (! node_read (super.s_root_block, ROOT))
     return 0;
   
   INFO->tree_depth = BLOCKHEAD (ROOT)->blk_level;
@@ -676,6 +922,10 @@ reiserfs_mount (void)
  *       if there is not enough space in the cache, the top most are
  *       omitted.
  *
+ * The nodes omitted from the path and the nodes of earlier paths are
+ * kept in the node cache in the extended memory, if there is enough
+ * of it (see node_read).
+ *
  * I have only two methods to find a key in the tree:
  *   search_stat(dir_id, objectid) searches for the stat entry (always
  *       the first entry) of an object.
@@ -708,7 +958,7 @@ read_tree_node (unsigned int blockNr, int depth)
   printf ("  next read_in: block=%d (depth=%d)\n",
 	  blockNr, depth);
 #endif /* REISERDEBUG */
-  if (! block_read (blockNr, 0, INFO->blocksize, cache))
+  if (! node_read (blockNr, cache))
     return 0;
   /* Make sure it has the right node level */
   if (BLOCKHEAD (cache)->blk_level != depth)
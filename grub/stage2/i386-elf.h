@@ -26,6 +26,14 @@ typedef signed long Elf32_Sword;
 typedef unsigned long Elf32_Word;
 /* "unsigned char" already exists */
 
+/* 64-bit data types */
+
+typedef unsigned long long Elf64_Addr;
+typedef unsigned short Elf64_Half;
+typedef unsigned long long Elf64_Off;
+typedef unsigned long Elf64_Word;
+typedef unsigned long long Elf64_Xword;
+
 /* ELF header */
 typedef struct
 {
@@ -159,6 +167,38 @@ Elf32_Sym;
 #define ELF32_R_INFO(__s, __t)	(((__s)<<8) + (unsigned char) (__t))
 
 
+/* ELF64 header, only for the images loaded by the physical addresses */
+typedef struct
+{
+  unsigned char e_ident[EI_NIDENT];
+  Elf64_Half e_type;
+  
+#define EM_X86_64	62	/* AMD x86-64 */
+  Elf64_Half e_machine;
+  Elf64_Word e_version;
+  Elf64_Addr e_entry;
+  Elf64_Off e_phoff;
+  Elf64_Off e_shoff;
+  Elf64_Word e_flags;
+  Elf64_Half e_ehsize;
+  Elf64_Half e_phentsize;
+  Elf64_Half e_phnum;
+  Elf64_Half e_shentsize;
+  Elf64_Half e_shnum;
+  Elf64_Half e_shstrndx;
+}
+Elf64_Ehdr;
+
+#define ELFCLASS64	2	/* x86-64 -- 64-bit data sizes present */
+
+#define BOOTABLE_X86_64_ELF(h) \
+ ((h.e_ident[EI_MAG0] == ELFMAG0) & (h.e_ident[EI_MAG1] == ELFMAG1) \
+  & (h.e_ident[EI_MAG2] == ELFMAG2) & (h.e_ident[EI_MAG3] == ELFMAG3) \
+  & (h.e_ident[EI_CLASS] == ELFCLASS64) & (h.e_ident[EI_DATA] == ELFDATA2LSB) \
+  & (h.e_ident[EI_VERSION] == EV_CURRENT) & (h.e_type == ET_EXEC) \
+  & (h.e_machine == EM_X86_64) & (h.e_version == EV_CURRENT))
+
+
 /* program header - page 5-2, figure 5-1 */
 
 typedef struct
@@ -174,6 +214,19 @@ typedef struct
 }
 Elf32_Phdr;
 
+typedef struct
+{
+  Elf64_Word p_type;
+  Elf64_Word p_flags;
+  Elf64_Off p_offset;
+  Elf64_Addr p_vaddr;
+  Elf64_Addr p_paddr;
+  Elf64_Xword p_filesz;
+  Elf64_Xword p_memsz;
+  Elf64_Xword p_align;
+}
+Elf64_Phdr;
+
 /* segment types - page 5-3, figure 5-2 */
 
 #define PT_NULL		0
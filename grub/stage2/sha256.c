@@ -0,0 +1,218 @@
+/* sha256.c - an implementation of the SHA-256 algorithm */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2005  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/* See FIPS 180-2 for a description of the SHA-256 algorithm.
+ */
+
+#include <shared.h>
+#include <sha256.h>
+
+typedef unsigned int UINT4;
+
+/* ROTATE_RIGHT rotates x right n bits.
+ */
+#define ROTATE_RIGHT(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* CH, MAJ and the sigma functions are the basic SHA-256 functions.
+ */
+#define CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SIGMA0(x) \
+  (ROTATE_RIGHT (x, 2) ^ ROTATE_RIGHT (x, 13) ^ ROTATE_RIGHT (x, 22))
+#define SIGMA1(x) \
+  (ROTATE_RIGHT (x, 6) ^ ROTATE_RIGHT (x, 11) ^ ROTATE_RIGHT (x, 25))
+#define sigma0(x) (ROTATE_RIGHT (x, 7) ^ ROTATE_RIGHT (x, 18) ^ ((x) >> 3))
+#define sigma1(x) (ROTATE_RIGHT (x, 17) ^ ROTATE_RIGHT (x, 19) ^ ((x) >> 10))
+
+/* Load a big-endian word.  */
+#define LOAD32(p) \
+  (((UINT4) (p)[0] << 24) | ((UINT4) (p)[1] << 16) \
+   | ((UINT4) (p)[2] << 8) | (UINT4) (p)[3])
+
+static const UINT4 initstate[8] =
+{
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const UINT4 K[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+  0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+  0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+  0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+  0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+  0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+  0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* The message schedule is kept in 16 words, and the word I is
+   computed from the previous ones in place.  */
+#define W(i) \
+  (w[(i) & 15] += (sigma1 (w[((i) - 2) & 15]) + w[((i) - 7) & 15] \
+		   + sigma0 (w[((i) - 15) & 15])))
+
+/* A round, in which the variables are renamed instead of being moved,
+   so that eight rounds make a cycle.  */
+#define ROUND(a, b, c, d, e, f, g, h, i, x) \
+  do \
+    { \
+      UINT4 t = h + SIGMA1 (e) + CH (e, f, g) + K[i] + (x); \
+      d += t; \
+      h = t + SIGMA0 (a) + MAJ (a, b, c); \
+    } \
+  while (0)
+
+#define ROUNDS8(i, x) \
+  do \
+    { \
+      ROUND (a, b, c, d, e, f, g, h, (i) + 0, x ((i) + 0)); \
+      ROUND (h, a, b, c, d, e, f, g, (i) + 1, x ((i) + 1)); \
+      ROUND (g, h, a, b, c, d, e, f, (i) + 2, x ((i) + 2)); \
+      ROUND (f, g, h, a, b, c, d, e, (i) + 3, x ((i) + 3)); \
+      ROUND (e, f, g, h, a, b, c, d, (i) + 4, x ((i) + 4)); \
+      ROUND (d, e, f, g, h, a, b, c, (i) + 5, x ((i) + 5)); \
+      ROUND (c, d, e, f, g, h, a, b, (i) + 6, x ((i) + 6)); \
+      ROUND (b, c, d, e, f, g, h, a, (i) + 7, x ((i) + 7)); \
+    } \
+  while (0)
+
+#define W0(i) (w[i])
+
+static void
+sha256_transform (UINT4 *state, const unsigned char *block)
+{
+  UINT4 a, b, c, d, e, f, g, h;
+  UINT4 w[16];
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = LOAD32 (block + i * 4);
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  ROUNDS8 (0, W0);
+  ROUNDS8 (8, W0);
+  ROUNDS8 (16, W);
+  ROUNDS8 (24, W);
+  ROUNDS8 (32, W);
+  ROUNDS8 (40, W);
+  ROUNDS8 (48, W);
+  ROUNDS8 (56, W);
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void
+sha256_init (struct sha256_ctx *ctx)
+{
+  grub_memmove ((char *) ctx->state, (char *) initstate,
+		sizeof (initstate));
+  ctx->length = 0;
+}
+
+void
+sha256_update (struct sha256_ctx *ctx, const char *data, int len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  int used = ctx->length & 63;
+
+  ctx->length += len;
+
+  /* Fill the partial block first.  */
+  if (used)
+    {
+      int n = 64 - used;
+
+      if (n > len)
+	n = len;
+
+      grub_memmove ((char *) ctx->buffer + used, (char *) p, n);
+      p += n;
+      len -= n;
+      if (used + n < 64)
+	return;
+
+      sha256_transform (ctx->state, ctx->buffer);
+    }
+
+  /* Hash the whole blocks in place, without copying them.  */
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_transform (ctx->state, p);
+
+  if (len)
+    grub_memmove ((char *) ctx->buffer, (char *) p, len);
+}
+
+void
+sha256_final (struct sha256_ctx *ctx, unsigned char *digest)
+{
+  unsigned int length = ctx->length;
+  unsigned char pad[72];
+  int padlen, i;
+
+  /* Pad with 0x80, zeros, and the length in bits, to a block
+     boundary.  */
+  padlen = 64 - ((length + 8) & 63);
+  pad[0] = 0x80;
+  for (i = 1; i < padlen; i++)
+    pad[i] = 0;
+
+  pad[padlen] = 0;
+  pad[padlen + 1] = 0;
+  pad[padlen + 2] = 0;
+  pad[padlen + 3] = length >> 29;
+  pad[padlen + 4] = length >> 21;
+  pad[padlen + 5] = length >> 13;
+  pad[padlen + 6] = length >> 5;
+  pad[padlen + 7] = length << 3;
+  sha256_update (ctx, (char *) pad, padlen + 8);
+
+  for (i = 0; i < 8; i++)
+    {
+      digest[i * 4] = ctx->state[i] >> 24;
+      digest[i * 4 + 1] = ctx->state[i] >> 16;
+      digest[i * 4 + 2] = ctx->state[i] >> 8;
+      digest[i * 4 + 3] = ctx->state[i];
+    }
+}
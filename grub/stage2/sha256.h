@@ -0,0 +1,45 @@
+/* sha256.h - an implementation of the SHA-256 algorithm */
+/*
+ *  GRUB  --  GRand Unified Bootloader
+ *  Copyright (C) 2005  Free Software Foundation, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef GRUB_SHA256_HEADER
+#define GRUB_SHA256_HEADER	1
+
+/* The length of a digest in bytes.  */
+#define SHA256_DIGEST_SIZE	32
+
+struct sha256_ctx
+{
+  unsigned int state[8];
+  /* The number of the bytes hashed so far.  */
+  unsigned int length;
+  unsigned char buffer[64];
+};
+
+/* Start computing a digest in CTX.  */
+extern void sha256_init (struct sha256_ctx *ctx);
+
+/* Add LEN bytes at DATA to the digest in CTX.  */
+extern void sha256_update (struct sha256_ctx *ctx, const char *data,
+			   int len);
+
+/* Finish computing the digest in CTX, and store it in DIGEST.  */
+extern void sha256_final (struct sha256_ctx *ctx, unsigned char *digest);
+
+#endif /* ! GRUB_SHA256_HEADER */
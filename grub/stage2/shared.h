@@ -126,6 +126,21 @@ extern char *grub_scratch_mem;
 #define MENU_BUF		(UNIQUE_BUF + UNIQUE_BUFLEN)
 #define MENU_BUFLEN		(0x8000 + PASSWORD_BUF - MENU_BUF)
 
+/* The buffer for the titles of the menu entries while reading a config
+   file, if the extended memory is large enough.  */
+#define MENU_EXT_BUF		RAW_ADDR (0x100000)
+#define MENU_EXT_BUFLEN		0x100000
+
+/* The arena for the caches in the extended memory. It is put in the
+   largest free memory region above MENU_EXT_BUF, and it is at most
+   EXTMEM_ARENA_MAX bytes.  */
+#define EXTMEM_ARENA_START	(0x100000 + MENU_EXT_BUFLEN)
+#define EXTMEM_ARENA_MAX	0x2000000
+
+/* The end of the config entries, the menu and its index. The rest is
+   left for the heap and the stack.  */
+#define CONFIG_END		(PROTSTACKINIT - 0x10000)
+
 /* The size of the drive map.  */
 #define DRIVE_MAP_SIZE		8
 
@@ -150,6 +165,9 @@ extern char *grub_scratch_mem;
 #define LINUX_BZIMAGE_ADDR		RAW_ADDR (0x100000)
 #define LINUX_ZIMAGE_ADDR		RAW_ADDR (0x10000)
 #define LINUX_OLD_REAL_MODE_ADDR	RAW_ADDR (0x90000)
+/* The real mode part above this is out of the buffers of GRUB, so it
+   can be read in place.  */
+#define LINUX_DIRECT_REAL_MODE_ADDR	(MENU_BUF + MENU_BUFLEN)
 #define LINUX_SETUP_STACK		0x9000
 
 #define LINUX_FLAG_BIG_KERNEL		0x1
@@ -415,6 +433,18 @@ struct linux_kernel_header
   unsigned short pad1;			/* Unused */
   char *cmd_line_ptr;			/* Points to the kernel command line */
   unsigned long initrd_addr_max;	/* The highest address of initrd */
+  unsigned long kernel_alignment;	/* Alignment of a relocatable kernel */
+  unsigned char relocatable_kernel;	/* If the kernel is relocatable */
+  unsigned char min_alignment;		/* Minimum alignment (power of 2) */
+  unsigned short xloadflags;		/* Extended boot protocol flags */
+  unsigned long cmdline_size;		/* The size of the command line */
+  unsigned long hardware_subarch;	/* Hardware subarchitecture */
+  unsigned long long hardware_subarch_data; /* Subarchitecture data */
+  unsigned long payload_offset;		/* The offset of the payload */
+  unsigned long payload_length;		/* The length of the payload */
+  unsigned long long setup_data;	/* The list of the setup data */
+  unsigned long long pref_address;	/* Preferred load address */
+  unsigned long init_size;		/* Memory needed to decompress */
 } __attribute__ ((packed));
 
 /* Memory map address range descriptor used by GET_MMAP_ENTRY. */
@@ -545,6 +575,8 @@ typedef enum
   ERR_DEV_NEED_INIT,
   ERR_NO_DISK_SPACE,
   ERR_NUMBER_OVERFLOW,
+  ERR_BAD_DIGEST,
+  ERR_NO_DIGEST,
 
   MAX_ERR_NUM
 } grub_error_t;
@@ -585,6 +617,10 @@ extern char *device_map_file;
 extern struct geometry *disks;
 /* Assign DRIVE to a device name DEVICE.  */
 extern void assign_device_name (int drive, const char *device);
+# ifdef SUPPORT_NETBOOT
+/* The specification of the emulated network device.  */
+extern char *net_device;
+# endif /* SUPPORT_NETBOOT */
 #endif
 
 #ifndef STAGE1_5
@@ -625,6 +661,12 @@ extern void (*disk_read_hook) (int, int, int);
 extern void (*disk_read_func) (int, int, int);
 
 #ifndef STAGE1_5
+/* If non-zero, only report the sectors to DISK_READ_FUNC.  */
+extern int disk_read_map_only;
+
+/* If non-zero, the file accesses are recorded in the trace.  */
+extern int trace_enabled;
+
 /* The flag for debug mode.  */
 extern int debug;
 #endif /* STAGE1_5 */
@@ -865,6 +907,7 @@ extern int grub_timeout;
 
 void init_builtins (void);
 void init_config (void);
+int read_default_file (char *buf, int len);
 char *skip_to (int after_equal, char *cmdline);
 struct builtin *find_command (char *command);
 void print_cmdline_message (int forever);
@@ -930,7 +973,10 @@ int gunzip_read (char *buf, int len);
 int rawread (int drive, int sector, int byte_offset, int byte_len, char *buf);
 int devread (int sector, int byte_offset, int byte_len, char *buf);
 int rawwrite (int drive, int sector, char *buf);
+int rawwrite_sectors (int drive, int sector, int count, char *buf);
 int devwrite (int sector, int sector_len, char *buf);
+/* The number of writes to the disks so far.  */
+extern unsigned long disk_write_count;
 
 /* Parse a device string and initialize the global parameters. */
 char *set_device (char *device);
@@ -963,6 +1009,132 @@ int grub_seek (int offset);
 /* Close a file.  */
 void grub_close (void);
 
+#ifndef STAGE1_5
+/* Read a file ahead into the arena, so that grub_read takes the data
+   from there later.  */
+int readahead_open (char *filename);
+int readahead_step (int len);
+void readahead_close (void);
+void cache_protect (int addr, int len);
+
+/* The block cache, which records the sectors of the files loaded by
+   the boot entries.  It consists of a header and records, each of
+   which is followed by the name of the file and its sector runs, and
+   these are written by the command "blockcache".  */
+#define BLOCKCACHE_MAGIC	0x6b6c4247	/* "GBlk" */
+#define BLOCKCACHE_MAXLEN	0x10000
+
+struct blockcache_header
+{
+  unsigned int magic;
+  /* The length of the records.  */
+  unsigned int len;
+  /* The checksum of the records.  */
+  unsigned int checksum;
+};
+
+struct blockcache_run
+{
+  /* The first sector, from the start of the partition.  */
+  unsigned int start;
+  unsigned int length;
+};
+
+struct blockcache_record
+{
+  /* The length of the record, including the name and the runs.  */
+  unsigned int len;
+  unsigned int drive;
+  unsigned int partition;
+  char fsys[12];
+  unsigned int size;
+  /* The sectors of the first and the last bytes of the file.  */
+  unsigned int first;
+  unsigned int last;
+  unsigned int runs;
+  char name[0];
+};
+
+#define BLOCKCACHE_END(cache)	\
+  ((struct blockcache_record *) ((char *) ((cache) + 1) + (cache)->len))
+#define BLOCKCACHE_NEXT(record)	\
+  ((struct blockcache_record *) ((char *) (record) + (record)->len))
+#define BLOCKCACHE_RUNS(record)	\
+  ((struct blockcache_run *) ((char *) BLOCKCACHE_NEXT (record)	\
+			      - ((record)->runs				\
+				 * sizeof (struct blockcache_run))))
+
+unsigned int blockcache_checksum (char *data, int len);
+int blockcache_load (char *filename);
+
+int verify_load (char *filename);
+int verify_file (void);
+
+/* The trace of the file accesses, which is recorded into a ring in the
+   arena by the command "trace".  A binary dump consists of a header,
+   the names of the files opened last, each of which is the serial
+   number of the file followed by TRACE_NAME_LEN bytes, and the events
+   from the oldest.  */
+#define TRACE_MAGIC		0x63725447	/* "GTrc" */
+#define TRACE_NAMES		32
+#define TRACE_NAME_LEN		64
+
+/* The types of the events.  */
+#define TRACE_OPEN		0	/* grub_open */
+#define TRACE_READ		1	/* grub_read */
+#define TRACE_DEVREAD		2	/* devread, called by a filesystem */
+#define TRACE_DISK		3	/* rawread, per track buffer */
+
+struct trace_header
+{
+  unsigned int magic;
+  /* The number of the events which the ring holds, or zero if there
+     is no trace.  */
+  unsigned int size;
+  /* The number of the events kept, and of those overwritten.  */
+  unsigned int count;
+  unsigned int lost;
+  /* The serial number of the file opened last.  */
+  unsigned int files;
+  /* The number of the file names.  */
+  unsigned int names;
+};
+
+struct trace_event
+{
+  unsigned char type;
+  /* The filesystem, an index into FSYS_TABLE, or NUM_FSYS if none.  */
+  unsigned char fsys;
+  /* Nonzero if nothing was read by the BIOS.  For TRACE_DISK, this
+     means that the track buffer had the data.  */
+  unsigned char hit;
+  unsigned char drive;
+  /* The serial number of the file opened last, counted from one.  */
+  unsigned int file;
+  /* The first sector, from the start of the partition for
+     TRACE_DEVREAD and of the disk for TRACE_DISK.  For TRACE_OPEN,
+     this is the start of the partition.  */
+  unsigned int sector;
+  /* The offset in the sector, or in the file for TRACE_READ.  For
+     TRACE_OPEN, this is the error number.  */
+  unsigned int offset;
+  /* The number of the bytes, or the size of the file for TRACE_OPEN.  */
+  unsigned int length;
+  /* The number of the sectors read by the BIOS.  */
+  unsigned int sectors;
+  /* The BIOS ticks at the start, and the ticks taken.  */
+  unsigned int ticks;
+  unsigned int elapsed;
+};
+
+int trace_on (int size);
+void trace_off (void);
+void trace_clear (void);
+void trace_header (struct trace_header *header);
+struct trace_event *trace_get (int n);
+char *trace_name (unsigned int file);
+#endif
+
 /* List the contents of the directory that was opened with GRUB_OPEN,
    printing all completions. */
 int dir (char *dirname);
@@ -994,6 +1166,23 @@ int load_module (char *module, char *arg);
 int load_initrd (char *initrd);
 
 int check_password(char *entered, char* expected, password_t type);
+
+/* The arena in the extended memory.  */
+extern unsigned long extmem_generation;
+extern int extmem_closed;
+void extmem_init (void);
+void *extmem_alloc (int size);
+void extmem_close (void);
+unsigned long extmem_base (void);
+void extmem_protect (char *addr, int len);
+
+/* The free memory in the memory map, and the placement of the images
+   in it.  */
+unsigned long mmap_avail_at (unsigned long bottom);
+void mem_place_reset (void);
+void mem_place_reserve (unsigned long addr, unsigned long len);
+unsigned long mem_place (unsigned long size, unsigned long align,
+			 unsigned long low, unsigned long high, int top_down);
 #endif
 
 void init_bios_info (void);
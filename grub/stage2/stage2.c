@@ -93,6 +93,131 @@ get_entry (char *list, int num, int nested)
   return list;
 }
 
+/* The index of the menu built by cmain. TITLE_INDEX[N] is the title of
+   the entry N, and CONFIG_INDEX[N] is its command list, so that an
+   entry can be found without walking all the entries before it.  */
+static char **title_index;
+static char **config_index;
+
+/* Get the title of the entry NUM in MENU_ENTRIES. A command list being
+   edited is not indexed, since it is modified in place.  */
+static char *
+get_title (char *menu_entries, int num)
+{
+  if (title_index && menu_entries == title_index[0])
+    return title_index[num];
+
+  return get_entry (menu_entries, num, 0);
+}
+
+/* Get the command list of the entry NUM in CONFIG_ENTRIES.  */
+static char *
+get_config (char *config_entries, int num)
+{
+  if (config_index && config_entries == config_index[0])
+    return config_index[num];
+
+  return get_entry (config_entries, num, 1);
+}
+
+/* The number of the bytes read ahead between two key polls.  */
+#define PREFETCH_SLICE	0x8000
+
+/* The next command of the default entry, whose files are read ahead
+   while the menu counts down, and the root device for them.  */
+static char *prefetch_entry;
+static unsigned long prefetch_drive;
+static unsigned long prefetch_partition;
+
+/* Start reading ahead the files loaded by the commands in ENTRY.  */
+static void
+prefetch_start (char *entry)
+{
+  prefetch_entry = entry;
+  prefetch_drive = saved_drive;
+  prefetch_partition = saved_partition;
+}
+
+/* Stop reading ahead the files, before the filesystem is used for
+   anything else.  */
+static void
+prefetch_stop (void)
+{
+  readahead_close ();
+  prefetch_entry = 0;
+}
+
+/* Read a slice of the files of the default entry.  Return zero if
+   there is nothing more to read.  */
+static int
+prefetch_step (void)
+{
+  if (readahead_step (PREFETCH_SLICE))
+    return 1;
+
+  /* Open the next file in the entry.  */
+  while (prefetch_entry && *prefetch_entry)
+    {
+      char *cmd = prefetch_entry;
+      char *arg = skip_to (1, cmd);
+      struct builtin *builtin;
+      unsigned long tmp_drive, tmp_partition;
+      int ret;
+
+      while (*prefetch_entry++)
+	;
+      
+      builtin = find_command (cmd);
+      errnum = ERR_NONE;
+      if (! builtin)
+	continue;
+
+      if (grub_strcmp (builtin->name, "root") == 0
+	  || grub_strcmp (builtin->name, "rootnoverify") == 0)
+	{
+	  /* Don't touch the current device, because the filesystem
+	     mounted on it is used as is later.  */
+	  tmp_drive = current_drive;
+	  tmp_partition = current_partition;
+	  ret = (set_device (arg) != 0);
+	  prefetch_drive = current_drive;
+	  prefetch_partition = current_partition;
+	  current_drive = tmp_drive;
+	  current_partition = tmp_partition;
+
+	  if (! ret)
+	    break;
+	  continue;
+	}
+
+      if (grub_strcmp (builtin->name, "kernel") == 0)
+	{
+	  /* Skip the options.  */
+	  while (grub_memcmp (arg, "--", 2) == 0)
+	    arg = skip_to (0, arg);
+	}
+      else if (grub_strcmp (builtin->name, "initrd") != 0
+	       && grub_strcmp (builtin->name, "module") != 0
+	       && grub_strcmp (builtin->name, "modulenounzip") != 0)
+	continue;
+
+      tmp_drive = saved_drive;
+      tmp_partition = saved_partition;
+      saved_drive = prefetch_drive;
+      saved_partition = prefetch_partition;
+      ret = readahead_open (arg);
+      saved_drive = tmp_drive;
+      saved_partition = tmp_partition;
+
+      if (ret)
+	return 1;
+    }
+
+  errnum = ERR_NONE;
+  prefetch_entry = 0;
+  return 0;
+}
+
 /* Print an entry in a line of the menu box.  */
 static void
 print_entry (int y, int highlight, char *entry)
@@ -138,7 +263,7 @@ print_entries (int y, int size, int first, int entryno, char *menu_entries)
   else
     grub_putchar (' ');
 
-  menu_entries = get_entry (menu_entries, first, 0);
+  menu_entries = get_title (menu_entries, first);
 
   for (i = 0; i < size; i++)
     {
@@ -172,12 +297,16 @@ print_entries_raw (int size, int first, char *menu_entries)
     grub_putchar ('-');
   grub_putchar ('\n');
 
+  menu_entries = get_title (menu_entries, first);
   for (i = first; i < size; i++)
     {
       /* grub's printf can't %02d so ... */
       if (i < 10)
 	grub_putchar (' ');
-      grub_printf ("%d: %s\n", i, get_entry (menu_entries, i, 0));
+      grub_printf ("%d: %s\n", i, menu_entries);
+
+      while (*(menu_entries++))
+	;
     }
 
   for (i = 0; i < LINE_LENGTH; i++)
@@ -231,7 +360,7 @@ static void
 run_menu (char *menu_entries, char *config_entries, int num_entries,
 	  char *heap, int entryno)
 {
-  int c, time1, time2 = -1, first_entry = 0;
+  int c, time1, time2 = -1, first_entry = 0, prefetch = 0;
   char *cur_entry = 0;
 
   /*
@@ -254,6 +383,14 @@ restart:
      interface. */
   if (grub_timeout < 0)
     show_menu = 1;
+
+  /* While counting down, read ahead the files of the default entry,
+     so that booting it takes the data from the memory.  */
+  if (grub_timeout > 0 && config_entries)
+    {
+      prefetch_start (get_config (config_entries, first_entry + entryno));
+      prefetch = 1;
+    }
   
   /* If SHOW_MENU is false, don't display the menu until ESC is pressed.  */
   if (! show_menu)
@@ -280,6 +417,11 @@ restart:
 	      if (grub_timeout <= 0)
 		{
 		  grub_timeout = -1;
+		  if (prefetch)
+		    {
+		      prefetch_stop ();
+		      prefetch = 0;
+		    }
 		  goto boot_entry;
 		}
 	      
@@ -290,9 +432,18 @@ restart:
 	      grub_printf ("\rPress `ESC' to enter the menu... %d   ",
 			   grub_timeout);
 	    }
+
+	  if (prefetch)
+	    prefetch = prefetch_step ();
 	}
     }
 
+  if (prefetch && grub_timeout < 0)
+    {
+      prefetch_stop ();
+      prefetch = 0;
+    }
+
   /* Only display the menu if the user wants to see it. */
   if (show_menu)
     {
@@ -347,6 +498,11 @@ restart:
 	  if (grub_timeout <= 0)
 	    {
 	      grub_timeout = -1;
+	      if (prefetch)
+		{
+		  prefetch_stop ();
+		  prefetch = 0;
+		}
 	      break;
 	    }
 
@@ -367,6 +523,9 @@ restart:
 	  grub_timeout--;
 	}
 
+      if (prefetch)
+	prefetch = prefetch_step ();
+
       /* Check for a keypress, however if TIMEOUT has been expired
 	 (GRUB_TIMEOUT == -1) relax in GETKEY even if no key has been
 	 pressed.  
@@ -374,6 +533,14 @@ restart:
 	 in grub if interrupt driven I/O is done).  */
       if (checkkey () >= 0 || grub_timeout < 0)
 	{
+	  /* The user may choose another entry or run commands, so stop
+	     reading ahead.  */
+	  if (prefetch)
+	    {
+	      prefetch_stop ();
+	      prefetch = 0;
+	    }
+	  
 	  /* Key was pressed, show which entry is selected before GETKEY,
 	     since we're comming in here also on GRUB_TIMEOUT == -1 and
 	     hang in GETKEY */
@@ -409,14 +576,12 @@ restart:
 		  if (entryno > 0)
 		    {
 		      print_entry (4 + entryno, 0,
-				   get_entry (menu_entries,
-					      first_entry + entryno,
-					      0));
+				   get_title (menu_entries,
+					      first_entry + entryno));
 		      entryno--;
 		      print_entry (4 + entryno, 1,
-				   get_entry (menu_entries,
-					      first_entry + entryno,
-					      0));
+				   get_title (menu_entries,
+					      first_entry + entryno));
 		    }
 		  else if (first_entry > 0)
 		    {
@@ -436,14 +601,12 @@ restart:
 		  if (entryno < 11)
 		    {
 		      print_entry (4 + entryno, 0,
-				   get_entry (menu_entries,
-					      first_entry + entryno,
-					      0));
+				   get_title (menu_entries,
+					      first_entry + entryno));
 		      entryno++;
 		      print_entry (4 + entryno, 1,
-				   get_entry (menu_entries,
-					      first_entry + entryno,
-					      0));
+				   get_title (menu_entries,
+					      first_entry + entryno));
 		  }
 		else if (num_entries > 12 + first_entry)
 		  {
@@ -490,9 +653,8 @@ restart:
 		{
 		  if (! (current_term->flags & TERM_DUMB))
 		    print_entry (4 + entryno, 0,
-				 get_entry (menu_entries,
-					    first_entry + entryno,
-					    0));
+				 get_title (menu_entries,
+					    first_entry + entryno));
 
 		  /* insert after is almost exactly like insert before */
 		  if (c == 'o')
@@ -507,9 +669,8 @@ restart:
 		      c = 'O';
 		    }
 
-		  cur_entry = get_entry (menu_entries,
-					 first_entry + entryno,
-					 0);
+		  cur_entry = get_title (menu_entries,
+					 first_entry + entryno);
 
 		  if (c == 'O')
 		    {
@@ -525,9 +686,8 @@ restart:
 		    }
 		  else if (num_entries > 0)
 		    {
-		      char *ptr = get_entry(menu_entries,
-					    first_entry + entryno + 1,
-					    0);
+		      char *ptr = get_title (menu_entries,
+					    first_entry + entryno + 1);
 
 		      grub_memmove (cur_entry, ptr,
 				    ((int) heap) - ((int) ptr));
@@ -626,17 +786,15 @@ restart:
 		  if (config_entries)
 		    {
 		      new_heap = heap;
-		      cur_entry = get_entry (config_entries,
-					     first_entry + entryno,
-					     1);
+		      cur_entry = get_config (config_entries,
+					     first_entry + entryno);
 		    }
 		  else
 		    {
 		      /* safe area! */
 		      new_heap = heap + NEW_HEAPSIZE + 1;
-		      cur_entry = get_entry (menu_entries,
-					     first_entry + entryno,
-					     0);
+		      cur_entry = get_title (menu_entries,
+					     first_entry + entryno);
 		    }
 
 		  do
@@ -719,12 +877,12 @@ restart:
     {
       if (config_entries)
 	printf ("  Booting \'%s\'\n\n",
-		get_entry (menu_entries, first_entry + entryno, 0));
+		get_title (menu_entries, first_entry + entryno));
       else
 	printf ("  Booting command-list\n\n");
 
       if (! cur_entry)
-	cur_entry = get_entry (config_entries, first_entry + entryno, 1);
+	cur_entry = get_config (config_entries, first_entry + entryno);
 
       /* Set CURRENT_ENTRYNO for the command "savedefault".  */
       current_entryno = first_entry + entryno;
@@ -832,7 +990,7 @@ get_line_from_config (char *cmdline, int maxlen, int read_from_file)
 void
 cmain (void)
 {
-  int config_len, menu_len, num_entries;
+  int config_len, menu_len, num_entries, menu_buflen;
   char *config_entries, *menu_entries;
   char *kill_buf = (char *) KILL_BUF;
 
@@ -844,9 +1002,43 @@ cmain (void)
       menu_len = 0;
       num_entries = 0;
       config_entries = (char *) mbi.drives_addr + mbi.drives_length;
-      menu_entries = (char *) MENU_BUF;
+      title_index = config_index = 0;
+
+      /* Collect the titles in the extended memory if possible, unless
+	 an OS image loaded by the command-line is there.  The config
+	 entries stay in the conventional memory, since the commands
+	 in them load images into the extended memory.  */
+      if (mbi.mem_upper >= (MENU_EXT_BUFLEN >> 10)
+	  && kernel_type == KERNEL_TYPE_NONE)
+	{
+	  menu_entries = (char *) MENU_EXT_BUF;
+	  menu_buflen = MENU_EXT_BUFLEN;
+	}
+      else
+	{
+	  menu_entries = (char *) MENU_BUF;
+	  menu_buflen = MENU_BUFLEN;
+	}
       init_config ();
     }
+
+  /* Check if LEN more bytes fit in the menu and the config entries.
+     The config entries are followed by the menu and its index, and
+     these must leave the space for the heap and the stack.  */
+  auto int menu_fits (int len);
+  int menu_fits (int len)
+    {
+      if (menu_len + len > menu_buflen
+	  || (config_entries + config_len + menu_len + len
+	      + 2 * (num_entries + 1) * sizeof (char *) + 4
+	      > (char *) CONFIG_END))
+	{
+	  errnum = ERR_WONT_FIT;
+	  return 0;
+	}
+
+      return 1;
+    }
   
   /* Initialize the environment for restarting Stage 2.  */
   grub_setjmp (restart_env);
@@ -881,21 +1073,26 @@ cmain (void)
 	      }
 	  default_file[i] = 0;
 	  grub_strncat (default_file + i, "default", DEFAULT_FILE_BUFLEN - i);
-	  if (grub_open (default_file))
-	    {
-	      char buf[10]; /* This is good enough.  */
-	      char *p = buf;
-	      int len;
-	      
-	      len = grub_read (buf, sizeof (buf));
-	      if (len > 0)
-		{
-		  buf[sizeof (buf) - 1] = 0;
-		  safe_parse_maxint (&p, &saved_entryno);
-		}
+	  {
+	    char buf[10]; /* This is good enough.  */
+	    char *p = buf;
 
-	      grub_close ();
-	    }
+	    /* This also records the sectors for the command savedefault.  */
+	    if (read_default_file (buf, sizeof (buf)) > 0)
+	      {
+		buf[sizeof (buf) - 1] = 0;
+		safe_parse_maxint (&p, &saved_entryno);
+	      }
+	  }
+
+	  /* Load the block cache next to the default file, and restore
+	     the name of the default file for the command savedefault.  */
+	  default_file[i] = 0;
+	  grub_strncat (default_file + i, "blockcache",
+			DEFAULT_FILE_BUFLEN - i);
+	  blockcache_load (default_file);
+	  default_file[i] = 0;
+	  grub_strncat (default_file + i, "default", DEFAULT_FILE_BUFLEN - i);
 	  errnum = ERR_NONE;
 	  
 	  do
@@ -938,6 +1135,9 @@ cmain (void)
 		    {
 		      char *ptr;
 		      
+		      if (! menu_fits (grub_strlen (cmdline) + 2))
+			break;
+
 		      /* the command "title" is specially treated.  */
 		      if (state > 1)
 			{
@@ -979,6 +1179,15 @@ cmain (void)
 		    {
 		      char *ptr = cmdline;
 		      
+		      if (! menu_fits (grub_strlen (cmdline) + 2))
+			{
+			  /* Drop this incomplete entry.  */
+			  menu_len = prev_menu_len;
+			  config_len = prev_config_len;
+			  state = 0;
+			  break;
+			}
+
 		      state++;
 		      /* Copy config file data to config area.  */
 		      while ((config_entries[config_len++] = *ptr++) != 0)
@@ -986,6 +1195,13 @@ cmain (void)
 		    }
 		}
 	      
+	      if (errnum)
+		{
+		  /* Use the entries read so far.  */
+		  print_error ();
+		  errnum = ERR_NONE;
+		}
+
 	      if (state > 1)
 		{
 		  /* Finish the last entry.  */
@@ -1058,9 +1274,30 @@ cmain (void)
 	}
       else
 	{
+	  char *config_ptr = config_entries, *menu_ptr = menu_entries;
+	  int i;
+
+	  /* Build the index of the entries after the menu, aligned to a
+	     word. The heap starts after the index.  */
+	  title_index = (char **) (((int) (menu_entries + menu_len) + 3)
+				   & ~3);
+	  config_index = title_index + num_entries;
+	  for (i = 0; i < num_entries; i++)
+	    {
+	      title_index[i] = menu_ptr;
+	      while (*(menu_ptr++))
+		;
+
+	      config_index[i] = config_ptr;
+	      while (*config_ptr)
+		while (*(config_ptr++))
+		  ;
+	      config_ptr++;
+	    }
+	  
 	  /* Run menu interface.  */
 	  run_menu (menu_entries, config_entries, num_entries,
-		    menu_entries + menu_len, default_entry);
+		    (char *) (config_index + num_entries), default_entry);
 	}
     }
 }